@@ -7,14 +7,26 @@
 * Sharath Kumar Dasari <sharathk@amd.com>
 ******************************************************************************/
 
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <mtd/mtd-user.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Error Codes */
@@ -31,7 +43,98 @@
 #define XBIU_IMG_REVISON_SIZE		(0x24U)
 #define XBIU_IMG_VERSION_SIZE		(0x4U)
 #define XBIU_IMG_VERSION_CHECK		(1.03F)
+#define XBIU_WRITE_CHUNK_SIZE		(0x10000U)
+#define XBIU_READ_CHUNK_SIZE		(0x400U)
+#define XBIU_PROGRESS_STEP			(10U)
+#define XBIU_STATE_DIR				"/var/lib/image_update"
+#define XBIU_WEAR_FILE				XBIU_STATE_DIR "/erase_count"
+#define XBIU_WEAR_WARN_THRESHOLD	(50000U)
+#define XBIU_WEAR_MAX_DEVS			(16U)
+#define XBIU_MTD_NAME_LEN			(16U)
+#define XBIU_MTD_PATH_LEN			(32U)
+#define XBIU_MTD_MAX_DEVS			(64U)
+#define XBIU_MTD_SYSFS_DIR			"/sys/class/mtd"
+#define XBIU_MTD_SYSFS_PATH_LEN		(64U)
+#define XBIU_CONFIG_REG_FILE		"/sys/firmware/zynqmp/config_reg"
+#define XBIU_CONFIG_REG_BUF_SIZE	(64U)
 
+#define XBIU_MANIFEST_FILE			XBIU_STATE_DIR "/manifest"
+#define XBIU_MANIFEST_MAX_DEVS		(8U)
+#define XBIU_SCRUB_RATE				(0x100000U)
+#define XBIU_STEP_YIELD_NS			(5000000L)
+#define XBIU_STREAM_DEPTH			(4U)
+#define XBIU_CRC_POLY				(0xEDB88320U)
+#define XBIU_CRC_PARALLEL_MIN		(0x400000U)
+#define XBIU_CRC_MAX_THREADS		(8U)
+#define XBIU_POOL_BUFS				(XBIU_STREAM_DEPTH + \
+						 XBIU_CRC_MAX_THREADS)
+#define XBIU_OOM_SCORE_ADJ_FILE		"/proc/self/oom_score_adj"
+#define XBIU_OOM_SCORE_ADJ_MIN		"-1000"
+#define XBIU_OOM_SCORE_ADJ_LEN		(16U)
+#define XBIU_HEARTBEAT_MS			(100U)
+#define XBIU_TIMING_FILE			XBIU_STATE_DIR "/timing_profile"
+#define XBIU_METRICS_STATE_FILE		XBIU_STATE_DIR "/metrics"
+#define XBIU_METRICS_FILE			"/var/lib/node_exporter/textfile_collector/image_update.prom"
+#define XBIU_METRICS_KEY_LEN		(64U)
+#define XBIU_CALIBRATE_ROUNDS		(3U)
+#define XBIU_DEF_ERASE_MS			(150.0)
+#define XBIU_DEF_PROGRAM_RATE		(0x80000U)
+#define XBIU_DEF_READ_RATE			(0x800000U)
+#define XBIU_HTTP_PREFIX			"http://"
+#define XBIU_HTTPS_PREFIX			"https://"
+#define XBIU_HTTP_HOST_LEN			(128U)
+#define XBIU_HTTP_PORT_LEN			(8U)
+#define XBIU_HTTP_PATH_LEN			(256U)
+#define XBIU_HTTP_HDR_LEN			(8192U)
+#define XBIU_HTTP_RETRIES			(5U)
+#define XBIU_HTTP_TIMEOUT			(30)
+#define XBIU_MAX_PART_HDRS			(32U)
+
+/* Boot header and partition header fields used to find the image length */
+#define XBIU_BH_SIZE				(0xA0U)
+#define XBIU_BH_FSBL_OFFSET			(0x30U)
+#define XBIU_BH_FSBL_TOTAL_LEN		(0x40U)
+#define XBIU_BH_PHT_OFFSET			(0x9CU)
+#define XBIU_PH_SIZE				(0x40U)
+#define XBIU_PH_TOTAL_WORD_LEN		(0x08U)
+#define XBIU_PH_NEXT_WORD_OFFSET	(0x0CU)
+#define XBIU_PH_DATA_WORD_OFFSET	(0x20U)
+
+/* I/O priority definitions, not exported by the C library */
+#define IOPRIO_CLASS_SHIFT			(13U)
+#define IOPRIO_CLASS_IDLE			(3U)
+#define IOPRIO_WHO_PROCESS			(1U)
+#ifndef SCHED_IDLE
+#define SCHED_IDLE					(5)
+#endif
+
+/* CSU/PMU registers accessible through XBIU_CONFIG_REG_FILE */
+#define CSU_MULTI_BOOT_REG			(0xFFCA0010U)
+#define CSU_MULTI_BOOT_MASK			(0x0FFFFFFFU)
+
+/* Long only command line options */
+enum xbiu_long_opt {
+	XBIU_OPT_CHUNK_SIZE = 0x100,
+	XBIU_OPT_NO_PROGRESS,
+	XBIU_OPT_WEAR_THRESHOLD,
+	XBIU_OPT_CLONE,
+	XBIU_OPT_SCRUB,
+	XBIU_OPT_SCRUB_INTERVAL,
+	XBIU_OPT_SCRUB_RATE,
+	XBIU_OPT_BW_LIMIT,
+	XBIU_OPT_IDLE,
+	XBIU_OPT_STEP_BUDGET,
+	XBIU_OPT_DRY_RUN,
+	XBIU_OPT_CALIBRATE,
+	XBIU_OPT_METRICS_FILE,
+	XBIU_OPT_HEARTBEAT,
+	XBIU_OPT_UNIT_TIMEOUT,
+	XBIU_OPT_RECOVERY,
+};
+
+/* Progress callback invoked by the chunked Qspi writer and readback */
+typedef void (*xbiu_progress_cb)(const char *phase, unsigned int done,
+				 unsigned int total, double elapsed);
 
 /* The below enums denote persistent registers in Qspi Flash */
 struct sys_persistent_state {
@@ -52,37 +155,344 @@ struct sys_boot_img_info {
 	unsigned int recovery_img_offset;
 } __packed;
 
+/*
+ * Source of the streaming Qspi writer. Reads up to len bytes at offset of
+ * the image into buf and returns the number of bytes read, which is only
+ * less than len at the end of the image, or -1 on failure.
+ */
+typedef int (*xbiu_stream_read)(void *ctx, char *buf, unsigned int offset,
+				unsigned int len);
+
+/* Erase block sized buffers handed from the stream reader to the writer */
+struct stream_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf[XBIU_STREAM_DEPTH];
+	unsigned int fill[XBIU_STREAM_DEPTH];
+	unsigned int head;
+	unsigned int count;
+	int done;
+	int error;
+	int stop;
+	unsigned int block_size;
+	unsigned int len;
+	xbiu_stream_read src;
+	void *ctx;
+};
+
+/* Stream source reading from a file descriptor at a base offset */
+struct fd_source {
+	int fd;
+	unsigned int base;
+};
+
+/* Stream source downloading the image from an HTTP server */
+struct http_source {
+	char host[XBIU_HTTP_HOST_LEN];
+	char port[XBIU_HTTP_PORT_LEN];
+	char path[XBIU_HTTP_PATH_LEN];
+	int sock;
+	unsigned int pos;
+	unsigned int len;
+};
+
+/*
+ * I/O buffers of at least one erase block, allocated and locked in memory
+ * once by pool_init. XBIU_POOL_BUFS covers the stream ring plus scratch
+ * buffers, or one buffer per thread of the parallel checksum.
+ */
+struct buf_pool {
+	pthread_mutex_t lock;
+	char *base;
+	unsigned int block_size;
+	unsigned int in_use;
+};
+
+/* Segment of data checksummed by one thread of the parallel checksum */
+struct crc_job {
+	int fd;
+	unsigned int base;
+	unsigned int len;
+	unsigned int crc;
+	int ret;
+	int heartbeat;
+};
+
+/* Measured Qspi timing used to predict the duration of an update */
+struct timing_profile {
+	unsigned int erasesize;
+	double erase_ms;
+	double program_rate;
+	double read_rate;
+};
+
+/* Region of an MTD device holding an image, such as the recovery image */
+struct image_region {
+	char mtd_file[XBIU_MTD_PATH_LEN];
+	unsigned int base;
+	unsigned int size;
+};
+
+/* Length and checksum of the image last written to an MTD partition */
+struct manifest_entry {
+	char dev[XBIU_MTD_NAME_LEN];
+	unsigned int len;
+	unsigned int crc;
+};
+
+/* Token bucket limiting the bandwidth of Qspi accesses */
+struct rate_limit {
+	unsigned int rate;
+	double tokens;
+	double last;
+	double stalled;
+};
+
+/* Measurements of the current run exported by metrics_export */
+struct run_metrics {
+	double write_sec;
+	double verify_sec;
+	double pers_reg_sec;
+	unsigned int bytes_written;
+	unsigned int pers_reg_commits;
+	unsigned int verify_failures;
+};
+
+/* Counters accumulated over all runs in XBIU_METRICS_STATE_FILE */
+struct metrics_totals {
+	unsigned long long runs;
+	unsigned long long failures;
+	unsigned long long updates;
+	unsigned long long verify_failures;
+	unsigned long long bytes_written;
+	unsigned long long pers_reg_commits;
+	unsigned long long last_update;
+};
+
+/* Erase counters of one MTD partition, one counter per erase block */
+struct wear_entry {
+	char dev[XBIU_MTD_NAME_LEN];
+	unsigned int erasesize;
+	unsigned int nblocks;
+	unsigned int *count;
+};
+
 enum sys_boot_img_id {
 	SYS_BOOT_IMG_A_ID = 0,
 	SYS_BOOT_IMG_B_ID = 1,
 };
 
 /* Function Declarations */
-static unsigned int calculate_checksum(void);
-static int update_image(char *qspi_mtd_file);
+static unsigned int calculate_checksum(struct sys_boot_img_info *info);
+static int update_image(char *qspi_mtd_file, unsigned int base,
+			unsigned int region_size);
 static int read_image_file(char *input_file);
+static int validate_image_header(const char *buf, unsigned int len);
+static int read_image_source(void *ctx, char *buf, unsigned int offset,
+			     unsigned int len);
+static void release_image_file(void);
+static int read_stream(int fd, char *buf, unsigned int len);
 static int update_nv_registers(char *qspi_mtd_pers_reg_file);
 static int update_persistent_registers(void);
 static void calculate_image_checksum(char *srcaddr, unsigned int len,
 				     unsigned int *calc_crc);
+static unsigned int crc_multmodp(unsigned int a, unsigned int b);
+static unsigned int crc_shift(unsigned int crc, unsigned int len);
+static void *crc_worker(void *arg);
+static int calculate_checksum_parallel(int fd, unsigned int base,
+				       unsigned int len,
+				       unsigned int *calc_crc);
+static int pool_init(void);
+static char *pool_get(unsigned int size);
+static void pool_put(char *buf);
+static void oom_protect(int enable);
+static void handle_cancel(int sig);
+static void install_cancel_handler(void);
+static int operation_cancelled(void);
+static int heartbeat_open(const char *heartbeat_file);
+static void heartbeat(void);
+static int bank_unit_end(double unit_start, unsigned int off);
+static void ring_wait(struct stream_ring *ring);
+static int wait_readable(int fd, int timeout_ms);
+static int stream_stopped(int timeout_ms);
 static void verify_current_running_image(void);
-static int validate_boot_img_info(void);
+static int validate_boot_img_info(struct sys_boot_img_info *info);
 static int read_persistent_register(void);
 static void print_persistent_status(void);
 static char* check_image_update_status(void);
-static int read_mtd_part(char *qspi_mtd_file);
+static int read_mtd_part(char *qspi_mtd_file,
+			 struct sys_boot_img_info *info);
 static char* get_nxt_img_update(void);
 static int print_qspi_mfg_info(void);
 static void print_usage(void);
-static int print_image_rev_info(char *qspi_mtd_file, char *image_name);
+static int print_image_rev_info(char *qspi_mtd_file, unsigned int base,
+				char *image_name);
 static int clear_multiboot_val(void);
+static int sysfs_write(const char *sysfs_file, const char *val);
+static int sysfs_read(const char *sysfs_file, char *buf, unsigned int size);
+static int config_reg_write(unsigned int reg, unsigned int mask,
+			    unsigned int val);
+static int config_reg_read(unsigned int reg, unsigned int *val);
 static int extract_image_version(char *qspi_mtd_file);
+static unsigned int get_write_chunk_size(mtd_info_t *qspi_mtd_info);
+static int write_full(int fd, char *buf, unsigned int len);
+static void print_progress(const char *phase, unsigned int done,
+			   unsigned int total, double elapsed);
+static double get_time_sec(void);
+static int parse_size(const char *str, unsigned int *size);
+static int parse_number(const char *str, unsigned int *val);
+static int erase_mtd(int fd, char *qspi_mtd_file, mtd_info_t *qspi_mtd_info,
+		     unsigned int start, unsigned int length);
+static const char *get_mtd_name(const char *qspi_mtd_file);
+static void wear_load(void);
+static int wear_save(void);
+static void wear_flush(void);
+static void wear_unload(void);
+static struct wear_entry *wear_get_entry(const char *dev,
+					 mtd_info_t *qspi_mtd_info);
+static void wear_record_erase(char *qspi_mtd_file, mtd_info_t *qspi_mtd_info,
+			      unsigned int start, unsigned int length);
+static unsigned int wear_get_max(struct wear_entry *entry);
+static void print_wear_info(void);
+static int verify_qspi_checksum(int fd, unsigned int base, unsigned int len,
+				unsigned int expected_crc);
+static int read_full(int fd, char *buf, unsigned int offset, unsigned int len);
+static unsigned int get_word(const char *buf, unsigned int offset);
+static int get_boot_image_length(int fd, unsigned int base,
+				 unsigned int region_size, unsigned int *len);
+static void *stream_reader(void *arg);
+static int stream_image(int fd, char *qspi_mtd_file,
+			mtd_info_t *qspi_mtd_info, unsigned int base,
+			unsigned int region_size, unsigned int len,
+			xbiu_stream_read src, void *ctx,
+			unsigned int *written, unsigned int *crc);
+static int stream_complete(int fd, unsigned int base,
+			   unsigned int region_size, unsigned int len,
+			   unsigned int done);
+static int read_fd_source(void *ctx, char *buf, unsigned int offset,
+			  unsigned int len);
+static int clone_image(char *src_mtd_file, char *qspi_mtd_file,
+		       unsigned int base, unsigned int region_size);
+static int program_bank(int fd, char *qspi_mtd_file,
+			mtd_info_t *qspi_mtd_info, unsigned int base,
+			unsigned int region_size, unsigned int len,
+			xbiu_stream_read src, void *ctx,
+			unsigned int *image_crc);
+static void throttle_step(void);
+static int is_http_url(const char *input_file);
+static int http_parse_url(const char *url, struct http_source *http);
+static int http_connect(struct http_source *http, unsigned int offset);
+static int http_recv(struct http_source *http, char *buf, unsigned int len);
+static void http_close(struct http_source *http);
+static int read_http_source(void *ctx, char *buf, unsigned int offset,
+			    unsigned int len);
+static int open_image_url(char *url);
+static int update_image_url(char *qspi_mtd_file, unsigned int base,
+			    unsigned int region_size);
+static char* get_nxt_img_update_mtd(void);
+static int pers_reg_differs(struct sys_boot_img_info *flash, int valid,
+			    struct sys_boot_img_info *info);
+static unsigned int plan_persistent_commits(void);
+static int timing_profile_load(struct timing_profile *profile);
+static int plan_update(char *input_file);
+static int calibrate_flash(void);
+static FILE *state_file_create(const char *tmp_file);
+static int state_file_commit(FILE *fp, const char *tmp_file,
+			     const char *state_file);
+static void manifest_load(void);
+static void manifest_store(char *qspi_mtd_file, unsigned int base,
+			   unsigned int len, unsigned int crc);
+static struct manifest_entry *manifest_lookup(const char *qspi_mtd_file,
+					      unsigned int base);
+static void get_manifest_key(const char *qspi_mtd_file, unsigned int base,
+			     char *key);
+static void rate_limit_init(struct rate_limit *rl, unsigned int rate);
+static void rate_limit_consume(struct rate_limit *rl, unsigned int bytes);
+static void set_idle_priority(void);
+static int scrub_mtd(char *qspi_mtd_file, char *image_name);
+static int scrub_persistent_registers(void);
+static int scrub_flash(void);
+static void metrics_load(struct metrics_totals *totals);
+static int metrics_save(struct metrics_totals *totals);
+static void metrics_header(FILE *fp, const char *name, const char *type,
+			   const char *help);
+static int metrics_export(const char *operation, int result,
+			  int pers_reg_valid);
+static int mtd_sysfs_attr(unsigned int idx, const char *attr,
+			  unsigned long long *val);
+static int resolve_image_region(unsigned int offset,
+				struct image_region *region);
+static int resolve_recovery_region(struct image_region *region);
+static void print_recovery_status(void);
+static int verify_recovery(void);
+static int update_recovery(char *src_mtd_file, int url_flag);
 
 /* Variable definitions */
-static char *srcaddr = NULL;
+static int image_fd = -1;
 static unsigned int image_size;
+static char *image_head;
+static unsigned int image_head_len;
+
+/* Main and backup persistent register partitions and their content in Qspi */
+static char *pers_reg_mtd_file[] = {"/dev/mtd2", "/dev/mtd3"};
+static struct sys_boot_img_info pers_reg_flash[2U];
+static int pers_reg_flash_valid[2U];
 static float img_ver;
 static struct sys_boot_img_info boot_img_info __attribute__ ((aligned(4U)));
+static unsigned int write_chunk_size;
+static xbiu_progress_cb progress_cb = print_progress;
+static struct wear_entry wear_table[XBIU_WEAR_MAX_DEVS];
+static unsigned int wear_entries;
+static int wear_loaded;
+static int wear_dirty;
+static unsigned int wear_threshold = XBIU_WEAR_WARN_THRESHOLD;
+static struct manifest_entry manifest_table[XBIU_MANIFEST_MAX_DEVS];
+static unsigned int manifest_entries;
+static int manifest_loaded;
+static unsigned int scrub_interval;
+static unsigned int scrub_rate = XBIU_SCRUB_RATE;
+static struct rate_limit update_rl;
+static unsigned int update_bw_limit;
+static unsigned int step_budget;
+static double step_start;
+static double step_yielded;
+static struct http_source http_src;
+static struct run_metrics run_metrics;
+static char *metrics_file = XBIU_METRICS_FILE;
+static int metrics_file_set;
+static struct buf_pool buf_pool = {PTHREAD_MUTEX_INITIALIZER, NULL, 0U, 0U};
+static char oom_score_adj_saved[XBIU_OOM_SCORE_ADJ_LEN];
+static volatile sig_atomic_t cancel_requested;
+static int heartbeat_fd = -1;
+static int heartbeat_seekable;
+static double heartbeat_last;
+static pthread_mutex_t heartbeat_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stream_stop_fd[2U] = {-1, -1};
+static unsigned int unit_timeout;
+
+static const struct option long_options[] = {
+	{"help", no_argument, NULL, 'h'},
+	{"print", no_argument, NULL, 'p'},
+	{"verify", no_argument, NULL, 'v'},
+	{"image", required_argument, NULL, 'i'},
+	{"chunk-size", required_argument, NULL, XBIU_OPT_CHUNK_SIZE},
+	{"no-progress", no_argument, NULL, XBIU_OPT_NO_PROGRESS},
+	{"wear-threshold", required_argument, NULL, XBIU_OPT_WEAR_THRESHOLD},
+	{"clone", no_argument, NULL, XBIU_OPT_CLONE},
+	{"scrub", no_argument, NULL, XBIU_OPT_SCRUB},
+	{"scrub-interval", required_argument, NULL, XBIU_OPT_SCRUB_INTERVAL},
+	{"scrub-rate", required_argument, NULL, XBIU_OPT_SCRUB_RATE},
+	{"bw-limit", required_argument, NULL, XBIU_OPT_BW_LIMIT},
+	{"idle", no_argument, NULL, XBIU_OPT_IDLE},
+	{"step-budget", required_argument, NULL, XBIU_OPT_STEP_BUDGET},
+	{"dry-run", no_argument, NULL, XBIU_OPT_DRY_RUN},
+	{"calibrate", no_argument, NULL, XBIU_OPT_CALIBRATE},
+	{"metrics-file", required_argument, NULL, XBIU_OPT_METRICS_FILE},
+	{"heartbeat", required_argument, NULL, XBIU_OPT_HEARTBEAT},
+	{"unit-timeout", required_argument, NULL, XBIU_OPT_UNIT_TIMEOUT},
+	{"recovery", no_argument, NULL, XBIU_OPT_RECOVERY},
+	{NULL, 0, NULL, 0}
+};
 
 static const unsigned int crc_table[] = {
 	0x00000000U, 0x77073096U, 0xEE0E612CU, 0x990951BAU,
@@ -174,15 +584,27 @@ int main(int argc, char *argv[])
 	int ret = XST_FAILURE;
 	char qspi_mtd_file[20U] = {0U};
 	char last_boot_img[20U] = {0U};
-	char image_file_name[100U] = {0U};
+	char image_file_name[XBIU_HTTP_PATH_LEN] = {0U};
 	char image_name[8] = {0U};
 	int opt;
 	int update_flag = 0;
 	int verify_flag = 0;
 	int help_flag = 0;
 	int print_flag = 0;
+	int clone_flag = 0;
+	int scrub_flag = 0;
+	int idle_flag = 0;
+	int url_flag = 0;
+	int dry_run_flag = 0;
+	int calibrate_flag = 0;
+	int recovery_flag = 0;
+	unsigned int multiboot;
+	char *running_name;
+	char *heartbeat_file = NULL;
+	const char *operation = "print";
 
-	while((opt = getopt(argc, argv, "hpvi")) != -1) {
+	while((opt = getopt_long(argc, argv, "hpvi:", long_options,
+				 NULL)) != -1) {
 		switch(opt)
 		{
 			case 'h':
@@ -204,9 +626,124 @@ int main(int argc, char *argv[])
 			case 'i':
 			{
 				update_flag = 1;
-				if (strlen(argv[optind]) <
+				if (strlen(optarg) <
 					sizeof(image_file_name)) {
-					strcpy(image_file_name, argv[optind]);
+					strcpy(image_file_name, optarg);
+				}
+			}
+				break;
+			case XBIU_OPT_CHUNK_SIZE:
+			{
+				if (parse_size(optarg, &write_chunk_size) !=
+				    XST_SUCCESS) {
+					printf("Invalid chunk size %s\n", optarg);
+					return ret;
+				}
+			}
+				break;
+			case XBIU_OPT_NO_PROGRESS:
+			{
+				progress_cb = NULL;
+			}
+				break;
+			case XBIU_OPT_WEAR_THRESHOLD:
+			{
+				if (parse_number(optarg, &wear_threshold) !=
+				    XST_SUCCESS) {
+					printf("Invalid wear threshold %s\n",
+					       optarg);
+					return ret;
+				}
+			}
+				break;
+			case XBIU_OPT_CLONE:
+			{
+				clone_flag = 1;
+			}
+				break;
+			case XBIU_OPT_SCRUB:
+			{
+				scrub_flag = 1;
+			}
+				break;
+			case XBIU_OPT_SCRUB_INTERVAL:
+			{
+				scrub_flag = 1;
+				if (parse_number(optarg, &scrub_interval) !=
+				    XST_SUCCESS) {
+					printf("Invalid scrub interval %s\n",
+					       optarg);
+					return ret;
+				}
+			}
+				break;
+			case XBIU_OPT_SCRUB_RATE:
+			{
+				if (parse_size(optarg, &scrub_rate) !=
+				    XST_SUCCESS) {
+					printf("Invalid scrub rate %s\n", optarg);
+					return ret;
+				}
+			}
+				break;
+			case XBIU_OPT_BW_LIMIT:
+			{
+				if (parse_size(optarg, &update_bw_limit) !=
+				    XST_SUCCESS) {
+					printf("Invalid bandwidth limit %s\n",
+					       optarg);
+					return ret;
+				}
+			}
+				break;
+			case XBIU_OPT_IDLE:
+			{
+				idle_flag = 1;
+			}
+				break;
+			case XBIU_OPT_STEP_BUDGET:
+			{
+				if (parse_number(optarg, &step_budget) !=
+				    XST_SUCCESS) {
+					printf("Invalid step budget %s\n",
+					       optarg);
+					return ret;
+				}
+			}
+				break;
+			case XBIU_OPT_DRY_RUN:
+			{
+				dry_run_flag = 1;
+			}
+				break;
+			case XBIU_OPT_CALIBRATE:
+			{
+				calibrate_flag = 1;
+			}
+				break;
+			case XBIU_OPT_METRICS_FILE:
+			{
+				metrics_file = optarg;
+				metrics_file_set = 1;
+			}
+				break;
+			case XBIU_OPT_RECOVERY:
+			{
+				recovery_flag = 1;
+			}
+				break;
+			case XBIU_OPT_HEARTBEAT:
+			{
+				heartbeat_file = optarg;
+			}
+				break;
+			case XBIU_OPT_UNIT_TIMEOUT:
+			{
+				if (parse_number(optarg, &unit_timeout) !=
+				    XST_SUCCESS) {
+					printf("Invalid unit timeout %s\n",
+					       optarg);
+					return ret;
 				}
 			}
 				break;
@@ -219,8 +756,26 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (recovery_flag == 1)
+		operation = (update_flag | clone_flag) ? "recovery_update" :
+			"recovery_verify";
+	else if (calibrate_flag == 1)
+		operation = "calibrate";
+	else if (scrub_flag == 1)
+		operation = "scrub";
+	else if (dry_run_flag == 1)
+		operation = "dry_run";
+	else if (clone_flag == 1)
+		operation = "clone";
+	else if (update_flag == 1)
+		operation = "update";
+	else if (verify_flag == 1)
+		operation = "verify";
+
 	ret = read_persistent_register();
 	if (ret != XST_SUCCESS) {
+		if (help_flag == 0)
+			(void)metrics_export(operation, ret, 0);
 		return ret;
 	}
 
@@ -229,45 +784,135 @@ int main(int argc, char *argv[])
 		return XST_SUCCESS;
 	}
 
-	if ((print_flag | verify_flag | update_flag) == 0) {
+	if (((print_flag | verify_flag | update_flag | clone_flag |
+	      scrub_flag | calibrate_flag | recovery_flag) == 0) ||
+	    (recovery_flag & (verify_flag | scrub_flag | dry_run_flag |
+			      calibrate_flag)) ||
+	    (update_flag & clone_flag) ||
+	    (scrub_flag & (verify_flag | update_flag | clone_flag)) ||
+	    (dry_run_flag & ((update_flag == 0) | verify_flag | scrub_flag)) ||
+	    (calibrate_flag & (verify_flag | update_flag | clone_flag |
+			       scrub_flag))) {
 		printf("Invalid command format!\n");
 		print_usage();
-		return ret;
+		return XST_FAILURE;
 	}
 
 	if (print_flag == 1) {
 		ret = print_qspi_mfg_info();
 		if (ret != XST_SUCCESS) {
-			return ret;
+			goto END;
+		}
+		print_wear_info();
+		if (config_reg_read(CSU_MULTI_BOOT_REG, &multiboot) ==
+		    XST_SUCCESS)
+			printf("Multiboot Register: 0x%08X\n", multiboot);
+	}
+
+	/* Buffers of all Qspi accesses below come from the locked pool */
+	if ((scrub_flag | calibrate_flag | dry_run_flag | update_flag |
+	     clone_flag | recovery_flag) && (pool_init() != XST_SUCCESS)) {
+		ret = XST_FAILURE;
+		goto END;
+	}
+
+	if (scrub_flag | update_flag | clone_flag | recovery_flag)
+		install_cancel_handler();
+	if (heartbeat_file &&
+	    (heartbeat_open(heartbeat_file) != XST_SUCCESS)) {
+		ret = XST_FAILURE;
+		goto END;
+	}
+
+	if (scrub_flag == 1) {
+		ret = scrub_flash();
+		goto END;
+	}
+
+	/* The recovery image is not tracked by the persistent registers */
+	if (recovery_flag == 1) {
+		if ((update_flag | clone_flag) == 0) {
+			ret = verify_recovery();
+			goto END;
+		}
+
+		printf("BootFW recovery image update started\n");
+		if (idle_flag == 1)
+			set_idle_priority();
+		rate_limit_init(&update_rl, update_bw_limit);
+		if (update_flag == 1) {
+			url_flag = is_http_url(image_file_name);
+			if (url_flag == 1)
+				ret = open_image_url(image_file_name);
+			else
+				ret = read_image_file(image_file_name);
+			if (ret != XST_SUCCESS)
+				goto END;
 		}
+
+		oom_protect(1);
+		if (boot_img_info.persistent_state.last_booted_img ==
+		    (char)SYS_BOOT_IMG_A_ID)
+			strcpy(last_boot_img, "/dev/mtd5");
+		else
+			strcpy(last_boot_img, "/dev/mtd7");
+		ret = update_recovery(clone_flag ? last_boot_img : NULL,
+				      url_flag);
+		if (ret == XST_SUCCESS)
+			printf("Recovery image successfully updated\n");
+		goto END;
+	}
+
+	if (calibrate_flag == 1) {
+		ret = calibrate_flash();
+		goto END;
+	}
+
+	if (dry_run_flag == 1) {
+		/* The planner only reads Qspi */
+		ret = plan_update(image_file_name);
+		goto END;
 	}
 
-	if ((verify_flag == 0) && (update_flag == 0)) {
+	if ((verify_flag == 0) && (update_flag == 0) && (clone_flag == 0)) {
 		/* image_update has been called with -p option only
 		 * and the command has been processed.
 		 */
-		return XST_SUCCESS;
+		ret = XST_SUCCESS;
+		goto END;
 	}
 
-	if(update_flag == 1){
+	if((update_flag == 1) || (clone_flag == 1)){
 		printf("BootFW image update started\n");
+		if (idle_flag == 1)
+			set_idle_priority();
+		rate_limit_init(&update_rl, update_bw_limit);
 	}
 
 	(void)verify_current_running_image();
 
+	oom_protect(1);
 	printf("Marking last booted image as bootable\n");
 	ret = update_persistent_registers();
-	if (ret < 0)
-		return XST_FAILURE;
+	if (ret != XST_SUCCESS)
+		goto END;
 
-	if (update_flag == 0) {
-		return ret;
+	if ((update_flag == 0) && (clone_flag == 0)) {
+		goto END;
 	}
 
-	printf("Reading BootFW image file\n");
-	ret = read_image_file(image_file_name);
-	if (ret != XST_SUCCESS)
-		goto END;
+	if (update_flag == 1) {
+		url_flag = is_http_url(image_file_name);
+		if (url_flag == 1) {
+			printf("Connecting to BootFW image URL\n");
+			ret = open_image_url(image_file_name);
+		} else {
+			printf("Reading BootFW image file\n");
+			ret = read_image_file(image_file_name);
+		}
+		if (ret != XST_SUCCESS)
+			goto END;
+	}
 
 	/* Input image would be written to a Qspi partition that does not
 	 * contain the current running image
@@ -279,23 +924,40 @@ int main(int argc, char *argv[])
 		boot_img_info.persistent_state.img_b_bootable = 0U;
 		strcpy(qspi_mtd_file, "/dev/mtd7");
 		strcpy(last_boot_img, "/dev/mtd5");
+		running_name = "ImageA";
 	} else {
 		printf("Updating BootFW image to ImageA bank\n");
 		strcpy(image_name, "ImageA");
 		boot_img_info.persistent_state.img_a_bootable = 0U;
 		strcpy(qspi_mtd_file, "/dev/mtd5");
 		strcpy(last_boot_img, "/dev/mtd7");
+		running_name = "ImageB";
 	}
 
 	printf("Marking target image as non bootable\n");
 	ret = update_persistent_registers();
-	if (ret < 0)
+	if (ret != XST_SUCCESS)
 		goto END;
 
-	printf("Writing BootFW image to %s bank\n",image_name);
-	ret = update_image(qspi_mtd_file);
-	if (ret != XST_SUCCESS)
+	if (clone_flag == 1) {
+		printf("Cloning %s bank to %s bank\n", running_name,
+		       image_name);
+		ret = clone_image(last_boot_img, qspi_mtd_file, 0U, 0U);
+		snprintf(image_file_name, sizeof(image_file_name), "%s bank",
+			 running_name);
+	} else if (url_flag == 1) {
+		printf("Downloading BootFW image to %s bank\n",image_name);
+		ret = update_image_url(qspi_mtd_file, 0U, 0U);
+	} else {
+		printf("Writing BootFW image to %s bank\n",image_name);
+		ret = update_image(qspi_mtd_file, 0U, 0U);
+	}
+	if (ret != XST_SUCCESS) {
+		if (cancel_requested)
+			printf("%s bank left non bootable, requested image unchanged\n",
+			       image_name);
 		goto END;
+	}
 
 	printf("Marking target image as non bootable and requested image\n");
 	if (boot_img_info.persistent_state.last_booted_img ==
@@ -308,7 +970,7 @@ int main(int argc, char *argv[])
 	}
 	/* Update persistent registers */
 	ret = update_persistent_registers();
-	if (ret < 0)
+	if (ret != XST_SUCCESS)
 		goto END;
 
 	ret = extract_image_version(last_boot_img);
@@ -328,26 +990,34 @@ int main(int argc, char *argv[])
 	printf("on successful boot\n");
 
 END:
-	if (srcaddr)
-		free(srcaddr);
+	wear_flush();
+	if (heartbeat_fd >= 0)
+		close(heartbeat_fd);
+	oom_protect(0);
+	release_image_file();
+	if (url_flag == 1)
+		http_close(&http_src);
+	(void)metrics_export(operation, ret, 1);
 	return ret;
 }
 
 /*****************************************************************************/
 /**
  * @brief
- * This function calculates the checksum of boot_img_info which reflects the
- * persistent registers in Qspi.
+ * This function calculates the checksum of a sys_boot_img_info structure
+ * which reflects the persistent registers in Qspi.
+ *
+ * @param	info points to the persistent registers
  *
- * @return	Checksum of boot_img_info variable
+ * @return	Checksum of info
  *
  *****************************************************************************/
-static unsigned int calculate_checksum(void)
+static unsigned int calculate_checksum(struct sys_boot_img_info *info)
 {
 	unsigned int idx;
 	unsigned int checksum = 0U;
-	unsigned int *data = (unsigned int *)&boot_img_info;
-	unsigned int boot_img_info_size = sizeof(boot_img_info) / 4U;
+	unsigned int *data = (unsigned int *)info;
+	unsigned int boot_img_info_size = sizeof(*info) / 4U;
 
 	for (idx = 0U; idx < SYS_CHECKSUM_OFFSET; idx++)
 		checksum += data[idx];
@@ -362,7 +1032,9 @@ static unsigned int calculate_checksum(void)
 /**
  * @brief
  * This function update both main and backup persistent register
- * status
+ * status. A copy is only erased and rewritten when its content in Qspi,
+ * as read at startup or last written, differs from boot_img_info or is
+ * corrupted.
  *
  * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
  *
@@ -370,16 +1042,27 @@ static unsigned int calculate_checksum(void)
 static int update_persistent_registers(void)
 {
 	int ret = XST_FAILURE;
+	unsigned int idx;
 
-	/* Update persistent register partition */
-	ret = update_nv_registers("/dev/mtd2");
-	if (ret < 0)
-		return ret;
+	boot_img_info.checksum = calculate_checksum(&boot_img_info);
 
-	/* Update persistent register backup partition */
-	ret = update_nv_registers("/dev/mtd3");
-	if (ret < 0)
-		return ret;
+	/* Update persistent register partition, then its backup */
+	for (idx = 0U; idx < 2U; idx++) {
+		if (!pers_reg_differs(&pers_reg_flash[idx],
+				      pers_reg_flash_valid[idx],
+				      &boot_img_info))
+			continue;
+
+		ret = update_nv_registers(pers_reg_mtd_file[idx]);
+		if (ret != XST_SUCCESS) {
+			/* Content unknown, rewrite the copy on the next commit */
+			pers_reg_flash_valid[idx] = 0;
+			return XST_FAILURE;
+		}
+
+		pers_reg_flash[idx] = boot_img_info;
+		pers_reg_flash_valid[idx] = 1;
+	}
 
 	ret = XST_SUCCESS;
 
@@ -401,8 +1084,8 @@ static int update_persistent_registers(void)
 static int update_nv_registers(char *qspi_mtd_pers_reg_file)
 {
 	int fd_pers_reg, ret = XST_FAILURE;
-	erase_info_t ei = {0U};
 	mtd_info_t qspi_mtd_info;
+	double start = get_time_sec();
 
 	fd_pers_reg = open(qspi_mtd_pers_reg_file, O_WRONLY);
 	if (fd_pers_reg < 0) {
@@ -417,9 +1100,8 @@ static int update_nv_registers(char *qspi_mtd_pers_reg_file)
 	}
 
 	/* Update persistent registers in Qspi */
-	ei.start = 0;
-	ei.length = qspi_mtd_info.size;
-	ret = ioctl(fd_pers_reg, MEMERASE, &ei);
+	ret = erase_mtd(fd_pers_reg, qspi_mtd_pers_reg_file, &qspi_mtd_info,
+			0U, qspi_mtd_info.size);
 	if (ret < 0) {
 		printf("Erase Qspi MTD partition failed\n");
 		goto END;
@@ -431,7 +1113,7 @@ static int update_nv_registers(char *qspi_mtd_pers_reg_file)
 		goto END;
 	}
 
-	boot_img_info.checksum = calculate_checksum();
+	boot_img_info.checksum = calculate_checksum(&boot_img_info);
 	ret = write(fd_pers_reg, (char *)&boot_img_info, sizeof(boot_img_info));
 	if (ret != sizeof(boot_img_info)) {
 		printf("Write Qspi MTD partition failed\n");
@@ -439,9 +1121,11 @@ static int update_nv_registers(char *qspi_mtd_pers_reg_file)
 		goto END;
 	}
 	ret = XST_SUCCESS;
+	run_metrics.pers_reg_commits++;
 
 END:
 	close(fd_pers_reg);
+	run_metrics.pers_reg_sec += get_time_sec() - start;
 	return ret;
 }
 
@@ -473,8 +1157,11 @@ static void verify_current_running_image(void)
 /*****************************************************************************/
 /**
  * @brief
- * This function copies the contents of input image file to local memory.
- * It validates the image by checking for "XLNX" identification string.
+ * This function opens the input image file for read_image_source and
+ * validates its "XLNX" identification string. The first bytes of other
+ * files such as pipes are read ahead into a pool buffer to be validated
+ * before any Qspi partition is touched. Pipes are left with image_size 0 as
+ * their size is only known at end of file.
  *
  * @param	input_file is the input image file
  *
@@ -483,74 +1170,208 @@ static void verify_current_running_image(void)
  *****************************************************************************/
 static int read_image_file(char *input_file)
 {
-	int fp, ret = XST_FAILURE;
+	int ret = XST_FAILURE;
 	struct stat image_details;
-	const char  *iden_str = "XNLX";
-	char *iden_str_ptr = NULL;
+	char header[XBIU_IDEN_STR_OFFSET + XBIU_IDEN_STR_LEN];
 
-	/* Open Image file and read contents */
-	fp = open(input_file, O_RDONLY);
-	if (fp < 0) {
+	/* Open Image file */
+	image_fd = open(input_file, O_RDONLY);
+	if (image_fd < 0) {
 		printf("Input image file open failed\n");
 		return ret;
 	}
 
-	ret = fstat(fp, &image_details);
+	ret = fstat(image_fd, &image_details);
 	if (ret != XST_SUCCESS) {
 		printf("Input image file stat read failed\n");
 		goto END;
 	}
 
-	image_size = image_details.st_size;
-	srcaddr = (char *)calloc(image_size, 1);
-	if (!srcaddr) {
-		printf("Allocation of memory for input image failed\n");
-		ret = XST_FAILURE;
-		goto END;
-	}
-	ret = read(fp, srcaddr, image_size);
-	if (ret != image_size) {
-		printf("Input image file read failed\n");
-		ret = XST_FAILURE;
-		goto END;
-	}
+	image_size = 0U;
+	if (S_ISREG(image_details.st_mode)) {
+		if ((image_details.st_size == 0) ||
+		    (image_details.st_size > 0xFFFFFFFFLL)) {
+			printf("Input image file size invalid\n");
+			ret = XST_FAILURE;
+			goto END;
+		}
+		image_size = image_details.st_size;
+		(void)posix_fadvise(image_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-	/* Validate Identification String of Image */
-	iden_str_ptr = &srcaddr[XBIU_IDEN_STR_OFFSET];
-	if (strncmp(iden_str_ptr, iden_str, XBIU_IDEN_STR_LEN) != 0) {
-		printf("Identification String Validation of image Failed!!\n");
-		ret = XST_FAILURE;
-		goto END;
+		ret = read_full(image_fd, header, 0U, sizeof(header));
+		ret = validate_image_header(header, (ret < 0) ? 0U :
+					    (unsigned int)ret);
+	} else {
+		image_head = pool_get(XBIU_WRITE_CHUNK_SIZE);
+		if (!image_head) {
+			printf("Allocation of input buffer failed\n");
+			ret = XST_FAILURE;
+			goto END;
+		}
+		ret = read_stream(image_fd, image_head, XBIU_WRITE_CHUNK_SIZE);
+		if (ret < 0)
+			goto END;
+		image_head_len = ret;
+		ret = validate_image_header(image_head, image_head_len);
 	}
-	ret = XST_SUCCESS;
 
 END:
-	close(fp);
+	if (ret != XST_SUCCESS)
+		release_image_file();
 	return ret;
 }
 
+/*****************************************************************************/
+/**
+ * @brief
+ * This function validates the image by checking for "XLNX" identification
+ * string in the first len bytes of the image.
+ *
+ * @param	buf points to the start of the image
+ * @param	len denotes number of bytes at buf
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int validate_image_header(const char *buf, unsigned int len)
+{
+	const char *iden_str = "XNLX";
+
+	if (len < (XBIU_IDEN_STR_OFFSET + XBIU_IDEN_STR_LEN)) {
+		printf("Input image file too small\n");
+		return XST_FAILURE;
+	}
+	if (strncmp(&buf[XBIU_IDEN_STR_OFFSET], iden_str,
+		    XBIU_IDEN_STR_LEN) != 0) {
+		printf("Identification String Validation of image Failed!!\n");
+		return XST_FAILURE;
+	}
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function is the stream source reading from the input image file
+ * opened by read_image_file. Pipes are read in order, which is how
+ * stream_reader requests the blocks, starting with the bytes read ahead by
+ * read_image_file.
+ *
+ * @param	ctx is unused
+ * @param	buf is a place holder for the data
+ * @param	offset is the offset in the image
+ * @param	len denotes number of bytes to read
+ *
+ * @return	Number of bytes read or -1 on failure
+ *
+ *****************************************************************************/
+static int read_image_source(void *ctx, char *buf, unsigned int offset,
+			     unsigned int len)
+{
+	unsigned int done = 0U;
+	int ret;
+
+	(void)ctx;
+	if (image_size != 0U)
+		return read_full(image_fd, buf, offset, len);
+
+	if (offset < image_head_len) {
+		done = image_head_len - offset;
+		if (done > len)
+			done = len;
+		memcpy(buf, image_head + offset, done);
+	}
+
+	ret = read_stream(image_fd, buf + done, len - done);
+	if (ret < 0)
+		return -1;
+
+	return (int)done + ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function reads len bytes from a pipe or socket, stopping early only
+ * at end of file. A cancel, or stream_image stopping the stream, interrupts
+ * the read.
+ *
+ * @param	fd is the file descriptor to read from
+ * @param	buf is a place holder for the data
+ * @param	len denotes number of bytes to read
+ *
+ * @return	Number of bytes read or -1 on failure
+ *
+ *****************************************************************************/
+static int read_stream(int fd, char *buf, unsigned int len)
+{
+	unsigned int done = 0U;
+	ssize_t ret;
+
+	while (done < len) {
+		if (wait_readable(fd, -1) != XST_SUCCESS)
+			return -1;
+		ret = read(fd, buf + done, len - done);
+		if (ret < 0) {
+			if (errno != EINTR)
+				printf("Input image file read failed\n");
+			else if (!cancel_requested)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return (int)done;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function closes the input image opened by read_image_file and
+ * returns the buffer holding the bytes read ahead from a pipe.
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void release_image_file(void)
+{
+	pool_put(image_head);
+	image_head = NULL;
+	image_head_len = 0U;
+
+	if (image_fd < 0)
+		return;
+
+	close(image_fd);
+	image_fd = -1;
+}
+
 /*****************************************************************************/
 /**
  * @brief
  * This function checks if the input image fits in Qspi partition. If yes, it
- * erases Qspi partition and writes the image to Qspi. The function then
- * compares checksums of input image file and data written in Qspi to validates
- * image write operation.
+ * erases Qspi partition and writes the image to Qspi one erase block at a
+ * time. The function then compares checksums of input image file and data
+ * written in Qspi to validates image write operation.
  *
  * @param	qspi_mtd_file denotes the mtd partition to be updated
+ * @param	base is the erase block aligned offset of the image region
+ * @param	region_size denotes the size of the image region, 0 for the
+ *		rest of the partition
  *
  * @return	XST_SUCCESS on SUCCESS and error code on failure
  *
  *****************************************************************************/
-static int update_image(char *qspi_mtd_file)
+static int update_image(char *qspi_mtd_file, unsigned int base,
+			unsigned int region_size)
 {
 	int fd, ret = XST_FAILURE;
-	erase_info_t ei = {0U};
 	mtd_info_t qspi_mtd_info;
 	unsigned int input_image_checksum = 0xFFFFFFFFU;
-	unsigned int qspi_image_checksum = 0xFFFFFFFFU;
-	char read_buffer[1024U];
-	unsigned int idx, len;
 
 	/* Qspi operations */
 	fd = open(qspi_mtd_file, O_RDWR);
@@ -564,64 +1385,3540 @@ static int update_image(char *qspi_mtd_file)
 		printf("retrieving MTD paartition info failed\n");
 		goto END;
 	}
+	if ((region_size == 0U) && (base < qspi_mtd_info.size))
+		region_size = qspi_mtd_info.size - base;
 
 	/* Validate Image Size */
-	if (image_size > qspi_mtd_info.size) {
+	if (image_size > region_size) {
 		printf("Image file too big to update. Update aborted\n");
 		ret = XST_FAILURE;
 		goto END;
 	}
 
-	ei.start = 0;
-	ei.length = qspi_mtd_info.size;
-	ret = ioctl(fd, MEMERASE, &ei);
-	if (ret < 0) {
-		printf("Erase Qspi MTD partition failed\n");
-		goto END;
-	}
-
-	ret = lseek(fd, 0, SEEK_SET);
-	if (ret != 0) {
-		printf("Seek Qspi MTD partition failed\n");
+	/* A pipe is checksummed as it is streamed */
+	if (image_size == 0U) {
+		ret = program_bank(fd, qspi_mtd_file, &qspi_mtd_info, base,
+				   region_size, 0U, read_image_source, NULL,
+				   NULL);
 		goto END;
 	}
 
-	ret = write(fd, (char *)srcaddr, image_size);
-	if (ret != image_size) {
-		printf("Write to Qspi MTD partition failed\n");
-		ret = XST_FAILURE;
+	/* Calculate checksum of the input image */
+	ret = calculate_checksum_parallel(image_fd, 0U, image_size,
+					  &input_image_checksum);
+	if (ret != XST_SUCCESS) {
+		printf("Input image file read failed\n");
 		goto END;
 	}
+	ret = program_bank(fd, qspi_mtd_file, &qspi_mtd_info, base,
+			   region_size, image_size, read_image_source, NULL,
+			   &input_image_checksum);
 
-	ret = lseek(fd, 0, SEEK_SET);
-	if (ret != 0) {
-		printf("Seek Qspi MTD partition failed\n");
+END:
+	close(fd);
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function reads back len bytes of the Qspi partition starting at base
+ * and compares their checksum with expected_crc. Large images are read
+ * back by calculate_checksum_parallel when the update is not throttled.
+ *
+ * @param	fd is the file descriptor of the Qspi partition
+ * @param	base is the offset of the image in the partition
+ * @param	len denotes number of bytes of the image
+ * @param	expected_crc is the checksum of the data written
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int verify_qspi_checksum(int fd, unsigned int base, unsigned int len,
+				unsigned int expected_crc)
+{
+	unsigned int qspi_image_checksum = 0xFFFFFFFFU;
+	char read_buffer[XBIU_READ_CHUNK_SIZE];
+	unsigned int cur, done;
+	double start = get_time_sec();
+
+	/* Unthrottled readback of large images is split across CPUs */
+	if ((update_bw_limit == 0U) && (len >= XBIU_CRC_PARALLEL_MIN)) {
+		if (calculate_checksum_parallel(fd, base, len,
+						&qspi_image_checksum) !=
+		    XST_SUCCESS) {
+			if (!operation_cancelled())
+				printf("Qspi checksum calculation failed\n");
+			return XST_FAILURE;
+		}
+		if (progress_cb)
+			progress_cb("Verifying", len, len,
+				    get_time_sec() - start);
+		len = 0U;
+	}
+
+	for (done = 0U; done < len; done += cur) {
+		if ((len - done) > XBIU_READ_CHUNK_SIZE)
+			cur = XBIU_READ_CHUNK_SIZE;
+		else
+			cur = len - done;
+
+		if (operation_cancelled())
+			return XST_FAILURE;
+		rate_limit_consume(&update_rl, cur);
+		if (read_full(fd, read_buffer, base + done, cur) !=
+		    (int)cur) {
+			printf("Qspi checksum calculation failed\n");
+			return XST_FAILURE;
+		}
+		heartbeat();
+		calculate_image_checksum(read_buffer, cur,
+					 &qspi_image_checksum);
+		if (progress_cb)
+			progress_cb("Verifying", done + cur, len,
+				    get_time_sec() - start);
+	}
+
+	if (expected_crc != qspi_image_checksum) {
+		printf("checksum mismatch!! Image update failed.\n");
+		run_metrics.verify_failures++;
+		return XST_FAILURE;
+	}
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function reads len bytes at offset of fd, retrying on short reads
+ * and on reads interrupted by a signal.
+ *
+ * @param	fd is the file descriptor to read from
+ * @param	buf is a place holder for the data
+ * @param	offset is the offset of the first byte to read
+ * @param	len denotes number of bytes to read
+ *
+ * @return	Number of bytes read, less than len only at end of file, or
+ *		-1 on failure
+ *
+ *****************************************************************************/
+static int read_full(int fd, char *buf, unsigned int offset, unsigned int len)
+{
+	unsigned int done = 0U;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(fd, buf + done, len - done, (off_t)offset + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return (int)done;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function returns the little endian 32 bit word at offset of buf.
+ *
+ * @param	buf points to the data
+ * @param	offset is the byte offset of the word
+ *
+ * @return	Value of the word
+ *
+ *****************************************************************************/
+static unsigned int get_word(const char *buf, unsigned int offset)
+{
+	const unsigned char *data = (const unsigned char *)buf + offset;
+
+	return data[0U] | (data[1U] << 8U) | (data[2U] << 16U) |
+		((unsigned int)data[3U] << 24U);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function finds the length of the boot image stored at base of fd
+ * from its boot header and partition headers. The length is the end of the
+ * furthest FSBL, partition header table or partition data.
+ *
+ * @param	fd is the file descriptor holding the boot image
+ * @param	base is the offset of the boot image
+ * @param	region_size denotes the size reserved for the boot image
+ * @param	len is a place holder for the image length
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int get_boot_image_length(int fd, unsigned int base,
+				 unsigned int region_size, unsigned int *len)
+{
+	char hdr[XBIU_BH_SIZE];
+	unsigned long long end, part_end;
+	unsigned int ph_offset, idx;
+
+	if (read_full(fd, hdr, base, XBIU_BH_SIZE) != XBIU_BH_SIZE)
+		return XST_FAILURE;
+
+	if (strncmp(&hdr[XBIU_IDEN_STR_OFFSET], "XNLX",
+		    XBIU_IDEN_STR_LEN) != 0)
+		return XST_FAILURE;
+
+	end = (unsigned long long)get_word(hdr, XBIU_BH_FSBL_OFFSET) +
+		get_word(hdr, XBIU_BH_FSBL_TOTAL_LEN);
+
+	ph_offset = get_word(hdr, XBIU_BH_PHT_OFFSET);
+	for (idx = 0U; (ph_offset != 0U) && (idx < XBIU_MAX_PART_HDRS);
+	     idx++) {
+		if (((unsigned long long)ph_offset + XBIU_PH_SIZE) >
+		    region_size)
+			return XST_FAILURE;
+		if (read_full(fd, hdr, base + ph_offset, XBIU_PH_SIZE) !=
+		    XBIU_PH_SIZE)
+			return XST_FAILURE;
+
+		if ((ph_offset + XBIU_PH_SIZE) > end)
+			end = ph_offset + XBIU_PH_SIZE;
+		part_end = ((unsigned long long)get_word(hdr,
+				XBIU_PH_DATA_WORD_OFFSET) +
+			    get_word(hdr, XBIU_PH_TOTAL_WORD_LEN)) * 4U;
+		if (part_end > end)
+			end = part_end;
+
+		ph_offset = get_word(hdr, XBIU_PH_NEXT_WORD_OFFSET) * 4U;
+	}
+
+	/* More partition headers than supported, the length would be short */
+	if ((ph_offset != 0U) || (end == 0U) || (end > region_size))
+		return XST_FAILURE;
+
+	*len = (unsigned int)end;
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function is the reader thread of stream_image. It fills erase block
+ * sized ring buffers from the stream source until the image is read.
+ *
+ * @param	arg points to the stream_ring
+ *
+ * @return	NULL
+ *
+ *****************************************************************************/
+static void *stream_reader(void *arg)
+{
+	struct stream_ring *ring = (struct stream_ring *)arg;
+	unsigned int offset = 0U, slot, len;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&ring->lock);
+		while ((ring->count == XBIU_STREAM_DEPTH) && !ring->stop)
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		if (ring->stop) {
+			pthread_mutex_unlock(&ring->lock);
+			break;
+		}
+		slot = (ring->head + ring->count) % XBIU_STREAM_DEPTH;
+		pthread_mutex_unlock(&ring->lock);
+
+		len = ring->block_size;
+		if ((ring->len != 0U) && ((ring->len - offset) < len))
+			len = ring->len - offset;
+
+		ret = ring->src(ring->ctx, ring->buf[slot], offset, len);
+
+		pthread_mutex_lock(&ring->lock);
+		if (ret < 0) {
+			ring->error = 1;
+		} else {
+			if (ret > 0) {
+				ring->fill[slot] = ret;
+				ring->count++;
+				offset += ret;
+			}
+			if (((unsigned int)ret < len) ||
+			    ((ring->len != 0U) && (offset == ring->len)))
+				ring->done = 1;
+		}
+		pthread_cond_broadcast(&ring->cond);
+		ret = ring->error || ring->done;
+		pthread_mutex_unlock(&ring->lock);
+		if (ret)
+			break;
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function streams an image from src into the Qspi partition one erase
+ * block at a time. A reader thread fetches the next blocks while the current
+ * block is erased and programmed. Only the erase blocks holding image data
+ * are erased. The checksum of the streamed data is returned in crc. Each
+ * erase block is a unit of bank_unit_end, so a cancel stops the stream
+ * between erase blocks.
+ *
+ * @param	fd is the file descriptor of the Qspi partition
+ * @param	qspi_mtd_file denotes the mtd partition to be updated
+ * @param	qspi_mtd_info is the MTD info of the partition
+ * @param	base is the erase block aligned offset of the image
+ * @param	region_size denotes the space available for the image
+ * @param	len denotes number of bytes of the image, 0 if unknown
+ * @param	src is the stream source
+ * @param	ctx is passed to src
+ * @param	written is a place holder for number of bytes programmed
+ * @param	crc is a place holder for the checksum of the image, NULL if
+ *		not needed
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int stream_image(int fd, char *qspi_mtd_file,
+			mtd_info_t *qspi_mtd_info, unsigned int base,
+			unsigned int region_size, unsigned int len,
+			xbiu_stream_read src, void *ctx,
+			unsigned int *written, unsigned int *crc)
+{
+	struct stream_ring ring;
+	pthread_t reader;
+	unsigned int idx, slot, fill, off, cur;
+	unsigned int chunk = get_write_chunk_size(qspi_mtd_info);
+	unsigned int done = 0U;
+	int ret = XST_FAILURE;
+	double start = get_time_sec();
+	double unit_start;
+
+	if ((qspi_mtd_info->erasesize == 0U) ||
+	    ((base % qspi_mtd_info->erasesize) != 0U) || (len > region_size))
+		return ret;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.block_size = qspi_mtd_info->erasesize;
+	ring.len = len;
+	ring.src = src;
+	ring.ctx = ctx;
+	for (idx = 0U; idx < XBIU_STREAM_DEPTH; idx++) {
+		ring.buf[idx] = pool_get(ring.block_size);
+		if (!ring.buf[idx]) {
+			printf("Allocation of stream buffers failed\n");
+			goto FREE;
+		}
+	}
+	if (pipe(stream_stop_fd) != 0) {
+		printf("Creating stream stop pipe failed\n");
+		stream_stop_fd[0U] = -1;
+		stream_stop_fd[1U] = -1;
+		goto FREE;
+	}
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.cond, NULL);
+
+	if (pthread_create(&reader, NULL, stream_reader, &ring) != 0) {
+		printf("Creating stream reader failed\n");
+		goto DESTROY;
+	}
+
+	if (crc)
+		*crc = 0xFFFFFFFFU;
+	for (;;) {
+		pthread_mutex_lock(&ring.lock);
+		while ((ring.count == 0U) && !ring.done && !ring.error &&
+		       !cancel_requested)
+			ring_wait(&ring);
+		if (operation_cancelled()) {
+			pthread_mutex_unlock(&ring.lock);
+			goto STOP;
+		}
+		if (ring.error) {
+			pthread_mutex_unlock(&ring.lock);
+			printf("Reading image stream failed\n");
+			goto STOP;
+		}
+		if (ring.count == 0U) {
+			pthread_mutex_unlock(&ring.lock);
+			break;
+		}
+		slot = ring.head;
+		fill = ring.fill[slot];
+		pthread_mutex_unlock(&ring.lock);
+
+		if ((region_size - done) < fill) {
+			printf("Image file too big to update. Update aborted\n");
+			goto STOP;
+		}
+
+		unit_start = get_time_sec();
+		if (erase_mtd(fd, qspi_mtd_file, qspi_mtd_info, base + done,
+			      ring.block_size) != XST_SUCCESS) {
+			printf("Erase Qspi MTD partition failed\n");
+			goto STOP;
+		}
+
+		if (lseek(fd, (off_t)base + done, SEEK_SET) !=
+		    ((off_t)base + done)) {
+			printf("Seek Qspi MTD partition failed\n");
+			goto STOP;
+		}
+		for (off = 0U; off < fill; off += cur) {
+			cur = fill - off;
+			if (cur > chunk)
+				cur = chunk;
+			rate_limit_consume(&update_rl, cur);
+			if (write_full(fd, ring.buf[slot] + off, cur) !=
+			    XST_SUCCESS) {
+				printf("Write to Qspi MTD partition failed\n");
+				goto STOP;
+			}
+			heartbeat();
+		}
+		if (crc)
+			calculate_image_checksum(ring.buf[slot], fill, crc);
+		if (bank_unit_end(unit_start, base + done) != XST_SUCCESS)
+			goto STOP;
+		done += fill;
+
+		pthread_mutex_lock(&ring.lock);
+		ring.head = (ring.head + 1U) % XBIU_STREAM_DEPTH;
+		ring.count--;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+		throttle_step();
+
+		if (progress_cb)
+			progress_cb("Writing", done, len ? len : done,
+				    get_time_sec() - start);
+	}
+
+	if (stream_complete(fd, base, region_size, len, done) !=
+	    XST_SUCCESS) {
+		printf("Image stream ended early\n");
+		goto STOP;
+	}
+	*written = done;
+	ret = XST_SUCCESS;
+
+STOP:
+	pthread_mutex_lock(&ring.lock);
+	ring.stop = 1;
+	pthread_cond_broadcast(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+	/* Wake a reader waiting on a pipe or socket, on every exit path */
+	if (write(stream_stop_fd[1U], "1", 1U) != 1)
+		printf("Stopping stream reader failed\n");
+	pthread_join(reader, NULL);
+DESTROY:
+	pthread_cond_destroy(&ring.cond);
+	pthread_mutex_destroy(&ring.lock);
+	close(stream_stop_fd[0U]);
+	close(stream_stop_fd[1U]);
+	stream_stop_fd[0U] = -1;
+	stream_stop_fd[1U] = -1;
+FREE:
+	for (idx = 0U; idx < XBIU_STREAM_DEPTH; idx++)
+		pool_put(ring.buf[idx]);
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function checks that a stream delivered the whole image. The end of
+ * a stream of unknown length may be a dropped connection or a closed pipe,
+ * so the boot and partition headers written must describe an image that
+ * ends within the data streamed.
+ *
+ * @param	fd is the file descriptor the image was written to
+ * @param	base is the offset of the image in fd
+ * @param	region_size denotes the space available for the image
+ * @param	len denotes number of bytes of the image, 0 if unknown
+ * @param	done denotes number of bytes streamed
+ *
+ * @return	XST_SUCCESS if the image is complete and XST_FAILURE otherwise
+ *
+ *****************************************************************************/
+static int stream_complete(int fd, unsigned int base,
+			   unsigned int region_size, unsigned int len,
+			   unsigned int done)
+{
+	unsigned int image_len;
+
+	if ((done == 0U) || ((len != 0U) && (done != len)))
+		return XST_FAILURE;
+
+	if ((len == 0U) &&
+	    ((get_boot_image_length(fd, base, region_size, &image_len) !=
+	      XST_SUCCESS) || (image_len > done)))
+		return XST_FAILURE;
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function is the stream source reading from a file descriptor.
+ *
+ * @param	ctx points to a fd_source
+ * @param	buf is a place holder for the data
+ * @param	offset is the offset in the image
+ * @param	len denotes number of bytes to read
+ *
+ * @return	Number of bytes read or -1 on failure
+ *
+ *****************************************************************************/
+static int read_fd_source(void *ctx, char *buf, unsigned int offset,
+			  unsigned int len)
+{
+	struct fd_source *source = (struct fd_source *)ctx;
+
+	return read_full(source->fd, buf, source->base + offset, len);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function writes an image of len bytes from src to an image region,
+ * such as a bank, with stream_image, erases the remainder of the region,
+ * validates the checksum of the data written and records it in the image
+ * manifest. When the update is throttled, the time added by throttling is
+ * reported.
+ *
+ * @param	fd is the file descriptor of the Qspi partition
+ * @param	qspi_mtd_file denotes the mtd partition to be updated
+ * @param	qspi_mtd_info is the MTD info of the partition
+ * @param	base is the erase block aligned offset of the region
+ * @param	region_size denotes the size of the region
+ * @param	len denotes number of bytes of the image, 0 if unknown
+ * @param	src is the stream source
+ * @param	ctx is passed to src
+ * @param	image_crc points to the checksum of the image when known in
+ *		advance, NULL to checksum the data as it is streamed
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int program_bank(int fd, char *qspi_mtd_file,
+			mtd_info_t *qspi_mtd_info, unsigned int base,
+			unsigned int region_size, unsigned int len,
+			xbiu_stream_read src, void *ctx,
+			unsigned int *image_crc)
+{
+	int ret;
+	unsigned int written, crc, off;
+	double start = get_time_sec();
+	double throttled = update_rl.stalled + step_yielded;
+	double elapsed, verify_start, unit_start;
+
+	if ((base > qspi_mtd_info->size) ||
+	    (region_size > (qspi_mtd_info->size - base)) ||
+	    ((base % qspi_mtd_info->erasesize) != 0U) ||
+	    ((region_size % qspi_mtd_info->erasesize) != 0U)) {
+		printf("Image region exceeds the Qspi MTD partition\n");
+		return XST_FAILURE;
+	}
+
+	step_start = start;
+	ret = stream_image(fd, qspi_mtd_file, qspi_mtd_info, base,
+			   region_size, len, src, ctx, &written,
+			   image_crc ? NULL : &crc);
+	if (ret != XST_SUCCESS)
+		return ret;
+	if (image_crc)
+		crc = *image_crc;
+
+	/* Erase the remainder of the region as a full update does */
+	off = base + ((written + qspi_mtd_info->erasesize - 1U) /
+		      qspi_mtd_info->erasesize) * qspi_mtd_info->erasesize;
+	for (; off < (base + region_size); off += qspi_mtd_info->erasesize) {
+		if (operation_cancelled())
+			return XST_FAILURE;
+		unit_start = get_time_sec();
+		if (erase_mtd(fd, qspi_mtd_file, qspi_mtd_info, off,
+			      qspi_mtd_info->erasesize) != XST_SUCCESS) {
+			printf("Erase Qspi MTD partition failed\n");
+			return XST_FAILURE;
+		}
+		if (bank_unit_end(unit_start, off) != XST_SUCCESS)
+			return XST_FAILURE;
+		throttle_step();
+	}
+	verify_start = get_time_sec();
+	run_metrics.write_sec += verify_start - start;
+	run_metrics.bytes_written += written;
+
+	ret = verify_qspi_checksum(fd, base, written, crc);
+	run_metrics.verify_sec += get_time_sec() - verify_start;
+	if (ret != XST_SUCCESS)
+		return ret;
+	manifest_store(qspi_mtd_file, base, written, crc);
+
+	if ((update_bw_limit != 0U) || (step_budget != 0U)) {
+		elapsed = get_time_sec() - start;
+		throttled = update_rl.stalled + step_yielded - throttled;
+		printf("Throttling added %.1fs to the %.1fs update (+%.0f%%)\n",
+		       throttled, elapsed, (elapsed > throttled) ?
+		       (100.0 * throttled) / (elapsed - throttled) : 0.0);
+	}
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function checks if the input image is given as an HTTP(S) URL.
+ *
+ * @param	input_file is the input image file or URL
+ *
+ * @return	1 for a URL and 0 otherwise
+ *
+ *****************************************************************************/
+static int is_http_url(const char *input_file)
+{
+	return (strncmp(input_file, XBIU_HTTP_PREFIX,
+			strlen(XBIU_HTTP_PREFIX)) == 0) ||
+		(strncmp(input_file, XBIU_HTTPS_PREFIX,
+			 strlen(XBIU_HTTPS_PREFIX)) == 0);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function splits an http://host[:port][/path] URL into http.
+ *
+ * @param	url is the URL of the image
+ * @param	http is a place holder for host, port and path
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int http_parse_url(const char *url, struct http_source *http)
+{
+	const char *host, *port, *path;
+	size_t host_len, port_len;
+
+	if (strncmp(url, XBIU_HTTPS_PREFIX, strlen(XBIU_HTTPS_PREFIX)) == 0) {
+		printf("HTTPS is not supported, use an http:// URL\n");
+		return XST_FAILURE;
+	}
+
+	host = url + strlen(XBIU_HTTP_PREFIX);
+	path = strchr(host, '/');
+	if (!path)
+		path = host + strlen(host);
+	port = memchr(host, ':', path - host);
+
+	host_len = (port ? port : path) - host;
+	port_len = port ? (size_t)(path - port - 1) : 0U;
+	if ((host_len == 0U) || (host_len >= sizeof(http->host)) ||
+	    (port_len >= sizeof(http->port)) ||
+	    (strlen(path) >= sizeof(http->path))) {
+		printf("Invalid image URL %s\n", url);
+		return XST_FAILURE;
+	}
+
+	memcpy(http->host, host, host_len);
+	http->host[host_len] = '\0';
+	if (port_len != 0U) {
+		memcpy(http->port, port + 1, port_len);
+		http->port[port_len] = '\0';
+	} else {
+		strcpy(http->port, "80");
+	}
+	strcpy(http->path, (*path != '\0') ? path : "/");
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function connects to the HTTP server and requests the image from
+ * offset on, using a Range request when offset is not 0. The image length
+ * is learnt from the first response; later responses must report the same
+ * length so that a download is never resumed into a different image.
+ *
+ * @param	http is the HTTP stream source
+ * @param	offset is the offset in the image to start the body at
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int http_connect(struct http_source *http, unsigned int offset)
+{
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv = {XBIU_HTTP_TIMEOUT, 0};
+	char hdr[XBIU_HTTP_HDR_LEN];
+	unsigned int idx = 0U, status = 0U, total = 0U, start = offset;
+	unsigned long long skip;
+	char *line, *next, *val;
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(http->host, http->port, &hints, &res) != 0) {
+		printf("Resolving %s failed\n", http->host);
+		return XST_FAILURE;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		http->sock = socket(ai->ai_family, ai->ai_socktype,
+				    ai->ai_protocol);
+		if (http->sock < 0)
+			continue;
+		setsockopt(http->sock, SOL_SOCKET, SO_RCVTIMEO, &tv,
+			   sizeof(tv));
+		setsockopt(http->sock, SOL_SOCKET, SO_SNDTIMEO, &tv,
+			   sizeof(tv));
+		if (connect(http->sock, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(http->sock);
+		http->sock = -1;
+	}
+	freeaddrinfo(res);
+	if (http->sock < 0) {
+		printf("Connecting to %s:%s failed\n", http->host, http->port);
+		return XST_FAILURE;
+	}
+
+	/* HTTP/1.0 keeps the body free of chunked transfer encoding */
+	if (offset != 0U)
+		snprintf(hdr, sizeof(hdr), "GET %s HTTP/1.0\r\nHost: %s\r\n"
+			 "User-Agent: image_update\r\nRange: bytes=%u-\r\n\r\n",
+			 http->path, http->host, offset);
+	else
+		snprintf(hdr, sizeof(hdr), "GET %s HTTP/1.0\r\nHost: %s\r\n"
+			 "User-Agent: image_update\r\n\r\n",
+			 http->path, http->host);
+	for (idx = 0U; idx < strlen(hdr); idx += ret) {
+		ret = send(http->sock, hdr + idx, strlen(hdr) - idx,
+			   MSG_NOSIGNAL);
+		if ((ret < 0) && (errno == EINTR)) {
+			ret = 0;
+		} else if (ret <= 0) {
+			printf("Sending HTTP request failed\n");
+			goto FAIL;
+		}
+	}
+
+	/* Read the response header up to the empty line */
+	idx = 0U;
+	while (idx < (sizeof(hdr) - 1U)) {
+		ret = recv(http->sock, &hdr[idx], 1U, 0);
+		if ((ret < 0) && (errno == EINTR))
+			continue;
+		if (ret <= 0)
+			break;
+		idx++;
+		if ((idx >= 4U) &&
+		    (strncmp(&hdr[idx - 4U], "\r\n\r\n", 4U) == 0))
+			break;
+	}
+	if ((idx < 4U) || (strncmp(&hdr[idx - 4U], "\r\n\r\n", 4U) != 0)) {
+		printf("Reading HTTP response failed\n");
+		goto FAIL;
+	}
+	hdr[idx] = '\0';
+
+	if (sscanf(hdr, "HTTP/%*u.%*u %u", &status) != 1) {
+		printf("Invalid HTTP response\n");
+		goto FAIL;
+	}
+	for (line = strstr(hdr, "\r\n"); line && (line[2] != '\r');
+	     line = next) {
+		line += 2;
+		next = strstr(line, "\r\n");
+		val = strchr(line, ':');
+		if (!val || (next && (val > next)))
+			continue;
+		for (val++; *val == ' '; val++)
+			;
+		if ((status == 200U) &&
+		    (strncasecmp(line, "Content-Length:", 15U) == 0))
+			total = strtoul(val, NULL, 10);
+		else if ((status == 206U) &&
+			 (strncasecmp(line, "Content-Range:", 14U) == 0) &&
+			 (sscanf(val, "bytes %u-%*u/%u", &start, &total) != 2))
+			total = 0U;
+	}
+
+	if ((status == 206U) && ((start != offset) || (total == 0U))) {
+		printf("Invalid HTTP range response\n");
+		goto FAIL;
+	} else if ((status != 200U) && (status != 206U)) {
+		printf("HTTP server returned status %u\n", status);
+		goto FAIL;
+	}
+
+	if ((http->len != 0U) && (total != http->len)) {
+		printf("Image on the HTTP server changed. Update aborted\n");
+		goto FAIL;
+	}
+	http->len = total;
+	http->pos = 0U;
+
+	/* The server ignored the Range request, skip to offset */
+	for (skip = offset; (status == 200U) && (skip != 0U); skip -= ret) {
+		ret = http_recv(http, hdr, (skip < sizeof(hdr)) ?
+				(unsigned int)skip : sizeof(hdr));
+		if (ret <= 0)
+			goto FAIL;
+	}
+	http->pos = offset;
+
+	return XST_SUCCESS;
+
+FAIL:
+	close(http->sock);
+	http->sock = -1;
+	return XST_FAILURE;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function receives up to len bytes of the response body.
+ *
+ * @param	http is the HTTP stream source
+ * @param	buf is a place holder for the data
+ * @param	len denotes number of bytes to receive
+ *
+ * @return	Number of bytes received, less than len only when the
+ *		connection was closed, or -1 on failure
+ *
+ *****************************************************************************/
+static int http_recv(struct http_source *http, char *buf, unsigned int len)
+{
+	unsigned int done = 0U;
+	ssize_t ret;
+
+	while (done < len) {
+		if (wait_readable(http->sock, XBIU_HTTP_TIMEOUT * 1000) !=
+		    XST_SUCCESS)
+			return -1;
+		ret = recv(http->sock, buf + done, len - done, 0);
+		if (ret < 0) {
+			if ((errno == EINTR) && !cancel_requested)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	http->pos += done;
+
+	return (int)done;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function closes the connection of an HTTP stream source.
+ *
+ * @param	http is the HTTP stream source
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void http_close(struct http_source *http)
+{
+	if (http->sock >= 0)
+		close(http->sock);
+	http->sock = -1;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function is the stream source downloading the image over HTTP. The
+ * stream engine asks for one erase block at a time, so when the connection
+ * drops the partial block is discarded and the download resumes with a
+ * Range request at the start of that block, right after the last block
+ * handed to the engine. The identification string of the image is
+ * validated on the first block.
+ *
+ * @param	ctx points to the http_source
+ * @param	buf is a place holder for the data
+ * @param	offset is the offset in the image
+ * @param	len denotes number of bytes to read
+ *
+ * @return	Number of bytes read or -1 on failure
+ *
+ *****************************************************************************/
+static int read_http_source(void *ctx, char *buf, unsigned int offset,
+			    unsigned int len)
+{
+	struct http_source *http = (struct http_source *)ctx;
+	unsigned int retry;
+	int ret;
+
+	for (retry = 0U; ; retry++) {
+		if ((http->sock >= 0) && (http->pos == offset)) {
+			ret = http_recv(http, buf, len);
+			if ((ret == (int)len) || ((ret >= 0) &&
+			    ((http->len == 0U) ||
+			     ((offset + ret) == http->len))))
+				break;
+		}
+
+		http_close(http);
+		if (cancel_requested || stream_stopped(0))
+			return -1;
+		if (retry == XBIU_HTTP_RETRIES) {
+			printf("Downloading image failed\n");
+			return -1;
+		}
+		if ((retry != 0U) || (offset != 0U))
+			printf("Resuming download at offset 0x%x\n", offset);
+		if ((retry != 0U) && stream_stopped(1000))
+			return -1;
+		(void)http_connect(http, offset);
+	}
+
+	if ((offset == 0U) && ((ret < (int)(XBIU_IDEN_STR_OFFSET +
+					    XBIU_IDEN_STR_LEN)) ||
+			       (strncmp(&buf[XBIU_IDEN_STR_OFFSET], "XNLX",
+					XBIU_IDEN_STR_LEN) != 0))) {
+		printf("Identification String Validation of image Failed!!\n");
+		return -1;
+	}
+
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function connects to the server of an image URL to check that the
+ * image can be downloaded and to learn its length before any Qspi
+ * partition is touched.
+ *
+ * @param	url is the URL of the image
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int open_image_url(char *url)
+{
+	memset(&http_src, 0, sizeof(http_src));
+	http_src.sock = -1;
+
+	if (http_parse_url(url, &http_src) != XST_SUCCESS)
+		return XST_FAILURE;
+
+	return http_connect(&http_src, 0U);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function streams the image opened by open_image_url into the Qspi
+ * partition, overlapping the download with erasing and programming. No
+ * copy of the image is kept in memory or in the file system.
+ *
+ * @param	qspi_mtd_file denotes the mtd partition to be updated
+ * @param	base is the erase block aligned offset of the image region
+ * @param	region_size denotes the size of the image region, 0 for the
+ *		rest of the partition
+ *
+ * @return	XST_SUCCESS on SUCCESS and error code on failure
+ *
+ *****************************************************************************/
+static int update_image_url(char *qspi_mtd_file, unsigned int base,
+			    unsigned int region_size)
+{
+	int fd, ret = XST_FAILURE;
+	mtd_info_t qspi_mtd_info;
+
+	fd = open(qspi_mtd_file, O_RDWR);
+	if (fd < 0) {
+		printf("Open Qspi MTD partition failed\n");
+		return ret;
+	}
+
+	ret = ioctl(fd, MEMGETINFO, &qspi_mtd_info);
+	if (ret != XST_SUCCESS) {
+		printf("retrieving MTD partition info failed\n");
+		goto END;
+	}
+	if ((region_size == 0U) && (base < qspi_mtd_info.size))
+		region_size = qspi_mtd_info.size - base;
+
+	if (http_src.len > region_size) {
+		printf("Image file too big to update. Update aborted\n");
+		ret = XST_FAILURE;
+		goto END;
+	}
+
+	ret = program_bank(fd, qspi_mtd_file, &qspi_mtd_info, base,
+			   region_size, http_src.len, read_http_source,
+			   &http_src, NULL);
+
+END:
+	close(fd);
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function gets the mtd partition of the next image bank to be updated
+ * based on current persistent status
+ *
+ * @return	/dev/mtd7 or /dev/mtd5 depending on persistent register status
+ *
+ *****************************************************************************/
+static char* get_nxt_img_update_mtd(void)
+{
+	if (boot_img_info.persistent_state.last_booted_img ==
+		(char)SYS_BOOT_IMG_A_ID)
+		return "/dev/mtd7";
+	else
+		return "/dev/mtd5";
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function checks if a persistent register copy in Qspi has to be
+ * rewritten to hold info.
+ *
+ * @param	flash is the content of the copy in Qspi
+ * @param	valid denotes whether the copy in Qspi is valid
+ * @param	info is the persistent register content to be committed
+ *
+ * @return	1 if the copy has to be rewritten and 0 otherwise
+ *
+ *****************************************************************************/
+static int pers_reg_differs(struct sys_boot_img_info *flash, int valid,
+			    struct sys_boot_img_info *info)
+{
+	return !valid || (memcmp(flash, info, sizeof(*info)) != 0);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function counts the persistent register copies an update would
+ * rewrite, replaying the persistent register changes done by main on local
+ * copies.
+ *
+ * @return	Number of persistent register partition rewrites
+ *
+ *****************************************************************************/
+static unsigned int plan_persistent_commits(void)
+{
+	struct sys_boot_img_info info = boot_img_info;
+	struct sys_boot_img_info flash[2U];
+	int valid[2U];
+	unsigned int step, idx, commits = 0U;
+	int img_a = (info.persistent_state.last_booted_img ==
+		     (char)SYS_BOOT_IMG_A_ID);
+
+	memcpy(flash, pers_reg_flash, sizeof(flash));
+	memcpy(valid, pers_reg_flash_valid, sizeof(valid));
+
+	for (step = 0U; step < 3U; step++) {
+		if (step == 0U) {
+			/* Mark running image bootable */
+			if (img_a)
+				info.persistent_state.img_a_bootable = 1U;
+			else
+				info.persistent_state.img_b_bootable = 1U;
+		} else if (step == 1U) {
+			/* Mark target image non bootable */
+			if (img_a)
+				info.persistent_state.img_b_bootable = 0U;
+			else
+				info.persistent_state.img_a_bootable = 0U;
+		} else {
+			/* Request target image */
+			info.persistent_state.requested_boot_img = img_a ?
+				(char)SYS_BOOT_IMG_B_ID : (char)SYS_BOOT_IMG_A_ID;
+		}
+
+		info.checksum = calculate_checksum(&info);
+		for (idx = 0U; idx < 2U; idx++) {
+			if (pers_reg_differs(&flash[idx], valid[idx], &info)) {
+				flash[idx] = info;
+				valid[idx] = 1;
+				commits++;
+			}
+		}
+	}
+
+	return commits;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function loads the Qspi timing profile measured by --calibrate.
+ * Without a profile, conservative QSPI NOR defaults are used.
+ *
+ * @param	profile is a place holder for the timing profile
+ *
+ * @return	XST_SUCCESS if a measured profile was loaded and XST_FAILURE
+ *		if defaults are used
+ *
+ *****************************************************************************/
+static int timing_profile_load(struct timing_profile *profile)
+{
+	FILE *fp;
+	int ret = XST_FAILURE;
+
+	profile->erasesize = 0U;
+	profile->erase_ms = XBIU_DEF_ERASE_MS;
+	profile->program_rate = XBIU_DEF_PROGRAM_RATE;
+	profile->read_rate = XBIU_DEF_READ_RATE;
+
+	fp = fopen(XBIU_TIMING_FILE, "r");
+	if (!fp)
+		return ret;
+
+	if ((fscanf(fp, "erasesize %u erase_ms %lf program_rate %lf "
+		    "read_rate %lf", &profile->erasesize, &profile->erase_ms,
+		    &profile->program_rate, &profile->read_rate) == 4) &&
+	    (profile->program_rate > 0.0) && (profile->read_rate > 0.0)) {
+		ret = XST_SUCCESS;
+	} else {
+		profile->erasesize = 0U;
+		profile->erase_ms = XBIU_DEF_ERASE_MS;
+		profile->program_rate = XBIU_DEF_PROGRAM_RATE;
+		profile->read_rate = XBIU_DEF_READ_RATE;
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function plans an update from input_file without writing to Qspi.
+ * It compares the image with the target bank erase block by erase block,
+ * lists the blocks whose content would change, counts the persistent
+ * register rewrites and predicts the duration of the update from the
+ * timing profile.
+ *
+ * @param	input_file is the input image file
+ *
+ * @return	XST_SUCCESS on SUCCESS and error code on failure
+ *
+ *****************************************************************************/
+static int plan_update(char *input_file)
+{
+	int fd, fd_reg, ret = XST_FAILURE;
+	mtd_info_t qspi_mtd_info;
+	struct timing_profile profile;
+	char *qspi_mtd_file = get_nxt_img_update_mtd();
+	char *buf = NULL, *img = NULL;
+	unsigned int blk, nblocks, off, cur, idx;
+	unsigned int changed = 0U, dirty = 0U, prog_blocks = 0U, commits;
+	unsigned int reg_blocks = 0U;
+	double erase_time, program_time, verify_time, reg_time;
+	mtd_info_t reg_mtd_info;
+
+	if (is_http_url(input_file)) {
+		printf("Dry run needs a local image file\n");
+		return ret;
+	}
+
+	ret = read_image_file(input_file);
+	if (ret != XST_SUCCESS)
+		return ret;
+	if (image_size == 0U) {
+		printf("Dry run needs a regular image file\n");
+		return XST_FAILURE;
+	}
+
+	fd = open(qspi_mtd_file, O_RDONLY);
+	if (fd < 0) {
+		printf("Open Qspi MTD partition failed\n");
+		return XST_FAILURE;
+	}
+
+	ret = ioctl(fd, MEMGETINFO, &qspi_mtd_info);
+	if ((ret != XST_SUCCESS) || (qspi_mtd_info.erasesize == 0U)) {
+		printf("retrieving MTD partition info failed\n");
+		ret = XST_FAILURE;
+		goto END;
+	}
+
+	if (image_size > qspi_mtd_info.size) {
+		printf("Image file too big to update. Update aborted\n");
+		ret = XST_FAILURE;
+		goto END;
+	}
+
+	buf = pool_get(qspi_mtd_info.erasesize);
+	img = pool_get(qspi_mtd_info.erasesize);
+	if (!buf || !img) {
+		printf("Allocation of compare buffer failed\n");
+		ret = XST_FAILURE;
+		goto END;
+	}
+
+	printf("Dry run of %s to %s bank (%s), Qspi is not modified\n",
+	       input_file, get_nxt_img_update(), qspi_mtd_file);
+	nblocks = qspi_mtd_info.size / qspi_mtd_info.erasesize;
+	for (blk = 0U; blk < nblocks; blk++) {
+		off = blk * qspi_mtd_info.erasesize;
+		if (read_full(fd, buf, off, qspi_mtd_info.erasesize) !=
+		    (int)qspi_mtd_info.erasesize) {
+			printf("Read Qspi MTD partition failed\n");
+			ret = XST_FAILURE;
+			goto END;
+		}
+
+		cur = 0U;
+		if (off < image_size) {
+			cur = image_size - off;
+			if (cur > qspi_mtd_info.erasesize)
+				cur = qspi_mtd_info.erasesize;
+			prog_blocks++;
+			if (read_full(image_fd, img, off, cur) != (int)cur) {
+				printf("Input image file read failed\n");
+				ret = XST_FAILURE;
+				goto END;
+			}
+		}
+
+		/* Data past the image must read back erased */
+		for (idx = cur; idx < qspi_mtd_info.erasesize; idx++) {
+			if (buf[idx] != (char)0xFF)
+				break;
+		}
+
+		if ((memcmp(buf, img, cur) != 0) ||
+		    (idx != qspi_mtd_info.erasesize)) {
+			if (off < image_size) {
+				printf("  block %4u at 0x%08x: erase and program\n",
+				       blk, off);
+				changed++;
+			} else {
+				printf("  block %4u at 0x%08x: erase\n", blk,
+				       off);
+				dirty++;
+			}
+		}
+	}
+
+	commits = plan_persistent_commits();
+	fd_reg = open(pers_reg_mtd_file[0U], O_RDONLY);
+	if (fd_reg >= 0) {
+		if ((ioctl(fd_reg, MEMGETINFO, &reg_mtd_info) == XST_SUCCESS) &&
+		    (reg_mtd_info.erasesize != 0U))
+			reg_blocks = reg_mtd_info.size / reg_mtd_info.erasesize;
+		close(fd_reg);
+	}
+
+	printf("Erase blocks in bank:        %u of %u bytes\n", nblocks,
+	       qspi_mtd_info.erasesize);
+	printf("Blocks holding the image:    %u\n", prog_blocks);
+	printf("Image blocks that change:    %u\n", changed);
+	printf("Blank blocks to be cleaned:  %u\n", dirty);
+	printf("Blocks already up to date:   %u\n",
+	       nblocks - changed - dirty);
+	printf("Persistent register commits: %u\n", commits);
+	printf("The update erases all %u blocks and programs %u bytes\n",
+	       nblocks, image_size);
+
+	if (timing_profile_load(&profile) != XST_SUCCESS)
+		printf("No timing profile, using defaults (run --calibrate)\n");
+	else if (profile.erasesize != qspi_mtd_info.erasesize)
+		printf("Timing profile was measured with %u byte erase blocks\n",
+		       profile.erasesize);
+
+	erase_time = nblocks * profile.erase_ms / 1000.0;
+	program_time = image_size / profile.program_rate;
+	verify_time = image_size / profile.read_rate;
+	if (update_bw_limit != 0U) {
+		if ((image_size / (double)update_bw_limit) > program_time)
+			program_time = image_size / (double)update_bw_limit;
+		if ((image_size / (double)update_bw_limit) > verify_time)
+			verify_time = image_size / (double)update_bw_limit;
+	}
+	reg_time = commits * ((reg_blocks * profile.erase_ms / 1000.0) +
+			      (sizeof(boot_img_info) / profile.program_rate));
+
+	printf("Predicted duration: %.1fs (erase %.1fs, program %.1fs, verify %.1fs, registers %.1fs)\n",
+	       erase_time + program_time + verify_time + reg_time,
+	       erase_time, program_time, verify_time, reg_time);
+	ret = XST_SUCCESS;
+
+END:
+	pool_put(buf);
+	pool_put(img);
+	close(fd);
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function measures erase, program and read timing of the Qspi flash
+ * on the last erase block of the inactive bank and stores it as timing
+ * profile. The block is only used when the image held by the bank has valid
+ * headers and ends before the block, and it is left erased.
+ *
+ * @return	XST_SUCCESS on SUCCESS and error code on failure
+ *
+ *****************************************************************************/
+static int calibrate_flash(void)
+{
+	int fd, ret = XST_FAILURE;
+	mtd_info_t qspi_mtd_info;
+	char *qspi_mtd_file = get_nxt_img_update_mtd();
+	char *pattern = NULL, *buf = NULL;
+	unsigned int len, off, round, idx;
+	double start, erase_time = 0.0, program_time = 0.0, read_time = 0.0;
+	FILE *fp;
+
+	fd = open(qspi_mtd_file, O_RDWR);
+	if (fd < 0) {
+		printf("Open Qspi MTD partition failed\n");
+		return ret;
+	}
+
+	ret = ioctl(fd, MEMGETINFO, &qspi_mtd_info);
+	if ((ret != XST_SUCCESS) || (qspi_mtd_info.erasesize == 0U) ||
+	    (qspi_mtd_info.size < qspi_mtd_info.erasesize)) {
+		printf("retrieving MTD partition info failed\n");
+		ret = XST_FAILURE;
+		goto END;
+	}
+
+	/* Scratch area is the last erase block of the inactive bank, used only
+	 * when the headers of its image show that the block is not part of it
+	 */
+	off = qspi_mtd_info.size - qspi_mtd_info.erasesize;
+	if ((get_boot_image_length(fd, 0U, qspi_mtd_info.size, &len) !=
+	     XST_SUCCESS) || (len > off)) {
+		printf("No free scratch block in %s bank\n",
+		       get_nxt_img_update());
+		ret = XST_FAILURE;
+		goto END;
+	}
+
+	pattern = pool_get(qspi_mtd_info.erasesize);
+	buf = pool_get(qspi_mtd_info.erasesize);
+	if (!pattern || !buf) {
+		printf("Allocation of calibration buffers failed\n");
+		ret = XST_FAILURE;
+		goto END;
+	}
+	for (idx = 0U; idx < qspi_mtd_info.erasesize; idx++)
+		pattern[idx] = (char)(idx * 0x9DU + (idx >> 8U));
+
+	printf("Calibrating on block at 0x%08x of %s bank\n", off,
+	       get_nxt_img_update());
+	for (round = 0U; round < XBIU_CALIBRATE_ROUNDS; round++) {
+		start = get_time_sec();
+		ret = erase_mtd(fd, qspi_mtd_file, &qspi_mtd_info, off,
+				qspi_mtd_info.erasesize);
+		erase_time += get_time_sec() - start;
+		if (ret != XST_SUCCESS) {
+			printf("Erase Qspi MTD partition failed\n");
+			goto END;
+		}
+
+		start = get_time_sec();
+		if ((lseek(fd, off, SEEK_SET) != (off_t)off) ||
+		    (write_full(fd, pattern, qspi_mtd_info.erasesize) !=
+		     XST_SUCCESS)) {
+			printf("Write to Qspi MTD partition failed\n");
+			ret = XST_FAILURE;
+			goto END;
+		}
+		program_time += get_time_sec() - start;
+
+		start = get_time_sec();
+		if (read_full(fd, buf, off, qspi_mtd_info.erasesize) !=
+		    (int)qspi_mtd_info.erasesize) {
+			printf("Read Qspi MTD partition failed\n");
+			ret = XST_FAILURE;
+			goto END;
+		}
+		read_time += get_time_sec() - start;
+
+		if (memcmp(pattern, buf, qspi_mtd_info.erasesize) != 0) {
+			printf("Calibration data mismatch\n");
+			ret = XST_FAILURE;
+			goto END;
+		}
+	}
+
+	ret = erase_mtd(fd, qspi_mtd_file, &qspi_mtd_info, off,
+			qspi_mtd_info.erasesize);
+	if (ret != XST_SUCCESS) {
+		printf("Erase Qspi MTD partition failed\n");
+		goto END;
+	}
+
+	/* Guard against timer resolution on very fast devices */
+	if (program_time <= 0.0)
+		program_time = 1e-6;
+	if (read_time <= 0.0)
+		read_time = 1e-6;
+
+	fp = state_file_create(XBIU_TIMING_FILE ".tmp");
+	if (!fp) {
+		printf("Storing timing profile failed\n");
+		ret = XST_FAILURE;
+		goto END;
+	}
+	fprintf(fp, "erasesize %u\nerase_ms %f\nprogram_rate %f\n"
+		"read_rate %f\n", qspi_mtd_info.erasesize,
+		erase_time * 1000.0 / XBIU_CALIBRATE_ROUNDS,
+		qspi_mtd_info.erasesize * XBIU_CALIBRATE_ROUNDS / program_time,
+		qspi_mtd_info.erasesize * XBIU_CALIBRATE_ROUNDS / read_time);
+	ret = state_file_commit(fp, XBIU_TIMING_FILE ".tmp", XBIU_TIMING_FILE);
+	if (ret != XST_SUCCESS) {
+		printf("Storing timing profile failed\n");
+		goto END;
+	}
+
+	printf("Erase %.1f ms/block, program %.2f MB/s, read %.2f MB/s\n",
+	       erase_time * 1000.0 / XBIU_CALIBRATE_ROUNDS,
+	       qspi_mtd_info.erasesize * XBIU_CALIBRATE_ROUNDS /
+	       program_time / 1000000.0,
+	       qspi_mtd_info.erasesize * XBIU_CALIBRATE_ROUNDS /
+	       read_time / 1000000.0);
+
+END:
+	pool_put(pattern);
+	pool_put(buf);
+	close(fd);
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function is called between erase blocks of an update. Once the
+ * update has been running for step_budget milliseconds since the last
+ * yield, it sleeps briefly to let other work use the CPU and the Qspi
+ * controller.
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void throttle_step(void)
+{
+	struct timespec ts = {0, XBIU_STEP_YIELD_NS};
+	double now;
+
+	if (step_budget == 0U)
+		return;
+
+	now = get_time_sec();
+	if (((now - step_start) * 1000.0) < step_budget)
+		return;
+
+	while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR))
+		;
+	step_start = get_time_sec();
+	step_yielded += step_start - now;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function copies the boot image of the running bank to the target
+ * bank without an input file. The image length is taken from the boot and
+ * partition headers of the running bank. The target bank is written by
+ * program_bank, as for an update from file, and its checksum is validated
+ * against the data read from the running bank.
+ *
+ * @param	src_mtd_file denotes the mtd partition of the running bank
+ * @param	qspi_mtd_file denotes the mtd partition to be updated
+ * @param	base is the erase block aligned offset of the target region
+ * @param	region_size denotes the size of the target region, 0 for the
+ *		rest of the partition
+ *
+ * @return	XST_SUCCESS on SUCCESS and error code on failure
+ *
+ *****************************************************************************/
+static int clone_image(char *src_mtd_file, char *qspi_mtd_file,
+		       unsigned int base, unsigned int region_size)
+{
+	int fd, ret = XST_FAILURE;
+	mtd_info_t src_mtd_info, qspi_mtd_info;
+	struct fd_source source = {-1, 0U};
+	unsigned int len;
+
+	source.fd = open(src_mtd_file, O_RDONLY);
+	if (source.fd < 0) {
+		printf("Open Qspi MTD partition failed\n");
+		return ret;
+	}
+
+	fd = open(qspi_mtd_file, O_RDWR);
+	if (fd < 0) {
+		printf("Open Qspi MTD partition failed\n");
+		goto CLOSE_SRC;
+	}
+
+	if ((ioctl(source.fd, MEMGETINFO, &src_mtd_info) != XST_SUCCESS) ||
+	    (ioctl(fd, MEMGETINFO, &qspi_mtd_info) != XST_SUCCESS)) {
+		printf("retrieving MTD partition info failed\n");
+		goto END;
+	}
+
+	if (get_boot_image_length(source.fd, 0U, src_mtd_info.size, &len) !=
+	    XST_SUCCESS) {
+		printf("Running image header is invalid. Clone aborted\n");
+		goto END;
+	}
+	if ((region_size == 0U) && (base < qspi_mtd_info.size))
+		region_size = qspi_mtd_info.size - base;
+
+	if (len > region_size) {
+		printf("Image file too big to update. Update aborted\n");
+		goto END;
+	}
+
+	ret = program_bank(fd, qspi_mtd_file, &qspi_mtd_info, base,
+			   region_size, len, read_fd_source, &source, NULL);
+
+END:
+	close(fd);
+CLOSE_SRC:
+	close(source.fd);
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function loads the image manifest from XBIU_MANIFEST_FILE. Each line
+ * holds the device name, length and checksum of the image last written to
+ * it by image_update.
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void manifest_load(void)
+{
+	FILE *fp;
+	struct manifest_entry *entry;
+
+	if (manifest_loaded)
+		return;
+	manifest_loaded = 1;
+
+	fp = fopen(XBIU_MANIFEST_FILE, "r");
+	if (!fp)
+		return;
+
+	while (manifest_entries < XBIU_MANIFEST_MAX_DEVS) {
+		entry = &manifest_table[manifest_entries];
+		if (fscanf(fp, "%15s %u %x", entry->dev, &entry->len,
+			   &entry->crc) != 3)
+			break;
+		manifest_entries++;
+	}
+
+	fclose(fp);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function records length and checksum of the image written to an MTD
+ * partition in the image manifest. Failing to store the manifest does not
+ * fail the update.
+ *
+ * @param	qspi_mtd_file denotes the mtd partition written
+ * @param	base is the offset of the image in the partition
+ * @param	len denotes number of bytes of the image
+ * @param	crc is the checksum of the image
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void manifest_store(char *qspi_mtd_file, unsigned int base,
+			   unsigned int len, unsigned int crc)
+{
+	struct manifest_entry *entry = manifest_lookup(qspi_mtd_file, base);
+	char dev[XBIU_MTD_NAME_LEN];
+	FILE *fp;
+	unsigned int idx;
+
+	if (!entry) {
+		get_manifest_key(qspi_mtd_file, base, dev);
+		if ((manifest_entries == XBIU_MANIFEST_MAX_DEVS) ||
+		    (dev[0U] == '\0'))
+			return;
+		entry = &manifest_table[manifest_entries++];
+		strcpy(entry->dev, dev);
+	}
+	entry->len = len;
+	entry->crc = crc;
+
+	fp = state_file_create(XBIU_MANIFEST_FILE ".tmp");
+	if (fp) {
+		for (idx = 0U; idx < manifest_entries; idx++)
+			fprintf(fp, "%s %u %08x\n", manifest_table[idx].dev,
+				manifest_table[idx].len,
+				manifest_table[idx].crc);
+		if (state_file_commit(fp, XBIU_MANIFEST_FILE ".tmp",
+				      XBIU_MANIFEST_FILE) == XST_SUCCESS)
+			return;
+	}
+	printf("Storing image manifest failed\n");
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function returns the image manifest entry of an image in an MTD
+ * partition.
+ *
+ * @param	qspi_mtd_file denotes the mtd partition
+ * @param	base is the offset of the image in the partition
+ *
+ * @return	Pointer to the entry or NULL if the image has none
+ *
+ *****************************************************************************/
+static struct manifest_entry *manifest_lookup(const char *qspi_mtd_file,
+					      unsigned int base)
+{
+	char dev[XBIU_MTD_NAME_LEN];
+	unsigned int idx;
+
+	get_manifest_key(qspi_mtd_file, base, dev);
+
+	manifest_load();
+	for (idx = 0U; idx < manifest_entries; idx++) {
+		if (strcmp(manifest_table[idx].dev, dev) == 0)
+			return &manifest_table[idx];
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function builds the image manifest key of an image: the MTD device
+ * name for an image at the start of its partition, otherwise the device
+ * name and the offset of the image (e.g. mtd0@1e00000).
+ *
+ * @param	qspi_mtd_file denotes the mtd partition
+ * @param	base is the offset of the image in the partition
+ * @param	key is a place holder of XBIU_MTD_NAME_LEN bytes for the key,
+ *		set to an empty string when the key does not fit
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void get_manifest_key(const char *qspi_mtd_file, unsigned int base,
+			     char *key)
+{
+	const char *dev = get_mtd_name(qspi_mtd_file);
+	int len;
+
+	if (base == 0U)
+		len = snprintf(key, XBIU_MTD_NAME_LEN, "%s", dev);
+	else
+		len = snprintf(key, XBIU_MTD_NAME_LEN, "%s@%x", dev, base);
+	if ((len < 0) || (len >= (int)XBIU_MTD_NAME_LEN))
+		key[0U] = '\0';
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function initializes a token bucket allowing rate bytes per second
+ * with a burst of up to one second worth of tokens.
+ *
+ * @param	rl is the token bucket
+ * @param	rate denotes the allowed bytes per second, 0 for no limit
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void rate_limit_init(struct rate_limit *rl, unsigned int rate)
+{
+	rl->rate = rate;
+	rl->tokens = rate;
+	rl->last = get_time_sec();
+	rl->stalled = 0.0;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function takes bytes tokens from the bucket, sleeping until the
+ * bucket refills when it runs out. Time spent sleeping is accounted in
+ * rl->stalled.
+ *
+ * @param	rl is the token bucket
+ * @param	bytes denotes number of bytes about to be transferred
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void rate_limit_consume(struct rate_limit *rl, unsigned int bytes)
+{
+	struct timespec ts;
+	double now, wait;
+
+	if (rl->rate == 0U)
+		return;
+
+	now = get_time_sec();
+	rl->tokens += (now - rl->last) * rl->rate;
+	if (rl->tokens > rl->rate)
+		rl->tokens = rl->rate;
+	rl->last = now;
+
+	rl->tokens -= bytes;
+	if (rl->tokens >= 0.0)
+		return;
+
+	wait = -rl->tokens / rl->rate;
+	ts.tv_sec = (time_t)wait;
+	ts.tv_nsec = (long)((wait - ts.tv_sec) * 1000000000.0);
+	while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR))
+		;
+	now = get_time_sec();
+	rl->stalled += now - rl->last;
+	rl->tokens += (now - rl->last) * rl->rate;
+	rl->last = now;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function moves the process to the idle I/O priority class and the
+ * SCHED_IDLE scheduling policy so that it only uses otherwise idle CPU and
+ * I/O time. Failures are reported and otherwise ignored.
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void set_idle_priority(void)
+{
+	struct sched_param param = {0};
+
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+		printf("Setting idle I/O priority failed\n");
+
+	if (sched_setscheduler(0, SCHED_IDLE, &param) != 0)
+		printf("Setting idle scheduling policy failed\n");
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function reads a whole MTD partition at the scrub rate. It checks
+ * the checksum of the image against the image manifest, and reports bad
+ * erase blocks and ECC errors seen during the read where the MTD device
+ * supports MEMGETBADBLOCK and ECCGETSTATS.
+ *
+ * @param	qspi_mtd_file denotes the mtd partition to be scrubbed
+ * @param	image_name is the string denoting the partition
+ *
+ * @return	XST_SUCCESS if no error was found and XST_FAILURE otherwise
+ *
+ *****************************************************************************/
+static int scrub_mtd(char *qspi_mtd_file, char *image_name)
+{
+	int fd, ret = XST_FAILURE;
+	mtd_info_t qspi_mtd_info;
+	struct mtd_ecc_stats ecc_start, ecc_end;
+	struct manifest_entry *entry = manifest_lookup(qspi_mtd_file, 0U);
+	struct rate_limit rl;
+	unsigned int off, cur, crc = 0xFFFFFFFFU, bad_blocks = 0U;
+	int has_ecc;
+	loff_t blk;
+	char *buf;
+
+	fd = open(qspi_mtd_file, O_RDONLY);
+	if (fd < 0) {
+		printf("Open Qspi MTD partition failed\n");
+		return ret;
+	}
+
+	buf = pool_get(XBIU_WRITE_CHUNK_SIZE);
+	if (!buf) {
+		printf("Allocation of scrub buffer failed\n");
+		goto END;
+	}
+
+	if (ioctl(fd, MEMGETINFO, &qspi_mtd_info) != XST_SUCCESS) {
+		printf("retrieving MTD partition info failed\n");
 		goto END;
 	}
 
-	/* Calculate and Validate checksum */
-	calculate_image_checksum(srcaddr, image_size, &input_image_checksum);
-	while (image_size > 0U) {
-		if (image_size > 1024U)
-			len = 1024U;
-		else
-			len = image_size;
+	/* Devices without bad block support fail the first query */
+	blk = 0;
+	if ((qspi_mtd_info.erasesize != 0U) &&
+	    (ioctl(fd, MEMGETBADBLOCK, &blk) >= 0)) {
+		for (; blk < qspi_mtd_info.size;
+		     blk += qspi_mtd_info.erasesize) {
+			if (ioctl(fd, MEMGETBADBLOCK, &blk) > 0)
+				bad_blocks++;
+		}
+	}
+
+	has_ecc = (ioctl(fd, ECCGETSTATS, &ecc_start) == 0);
+
+	rate_limit_init(&rl, scrub_rate);
+	for (off = 0U; off < qspi_mtd_info.size; off += cur) {
+		cur = qspi_mtd_info.size - off;
+		if (cur > XBIU_WRITE_CHUNK_SIZE)
+			cur = XBIU_WRITE_CHUNK_SIZE;
+
+		if (operation_cancelled())
+			goto END;
+		rate_limit_consume(&rl, cur);
+		if (read_full(fd, buf, off, cur) != (int)cur) {
+			printf("%s: read failed at offset 0x%x\n", image_name,
+			       off);
+			goto END;
+		}
+		if (entry && (off < entry->len))
+			calculate_image_checksum(buf, (entry->len - off) < cur ?
+						 entry->len - off : cur, &crc);
+	}
+
+	ret = XST_SUCCESS;
+	printf("%s: ", image_name);
+	if (!entry) {
+		printf("no manifest");
+	} else if ((entry->len > qspi_mtd_info.size) || (crc != entry->crc)) {
+		printf("checksum mismatch");
+		ret = XST_FAILURE;
+	} else {
+		printf("checksum OK");
+	}
+	if (bad_blocks != 0U) {
+		printf(", %u bad blocks", bad_blocks);
+		ret = XST_FAILURE;
+	}
+	if (has_ecc && (ioctl(fd, ECCGETSTATS, &ecc_end) == 0)) {
+		printf(", ECC corrected %u failed %u",
+		       ecc_end.corrected - ecc_start.corrected,
+		       ecc_end.failed - ecc_start.failed);
+		if (ecc_end.failed != ecc_start.failed)
+			ret = XST_FAILURE;
+	}
+	printf("\n");
+
+END:
+	pool_put(buf);
+	close(fd);
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function re-reads the main and backup persistent registers and
+ * rewrites a copy that is corrupted or differs from the main copy with the
+ * content of the good copy.
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int scrub_persistent_registers(void)
+{
+	int ret;
+
+	ret = read_persistent_register();
+	if (ret != XST_SUCCESS)
+		return ret;
+
+	if (pers_reg_flash_valid[0U] && pers_reg_flash_valid[1U] &&
+	    (memcmp(&pers_reg_flash[0U], &pers_reg_flash[1U],
+		    sizeof(pers_reg_flash[0U])) == 0)) {
+		printf("Persistent registers: OK\n");
+		return XST_SUCCESS;
+	}
+
+	printf("Persistent registers: repairing %s copy\n",
+	       pers_reg_flash_valid[0U] ? "backup" : "main");
+	ret = update_persistent_registers();
+	if (ret != XST_SUCCESS)
+		return XST_FAILURE;
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function scrubs both image banks and the persistent registers at
+ * idle priority, once or every scrub_interval seconds.
+ *
+ * @return	XST_SUCCESS if no error was found and XST_FAILURE otherwise
+ *
+ *****************************************************************************/
+static int scrub_flash(void)
+{
+	int ret;
+
+	set_idle_priority();
+
+	for (;;) {
+		/* Pick up manifests and counters stored by updates meanwhile */
+		manifest_loaded = 0;
+		manifest_entries = 0U;
+		wear_unload();
+
+		ret = scrub_persistent_registers();
+		if (scrub_mtd("/dev/mtd5", "ImageA") != XST_SUCCESS)
+			ret = XST_FAILURE;
+		if (scrub_mtd("/dev/mtd7", "ImageB") != XST_SUCCESS)
+			ret = XST_FAILURE;
+		wear_flush();
+		fflush(stdout);
+
+		if ((scrub_interval == 0U) || cancel_requested)
+			break;
+		/* A cancel ends the sleep early, keep the last pass result */
+		sleep(scrub_interval);
+		if (cancel_requested)
+			break;
+	}
+
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function returns the number of bytes handed to each write() call on
+ * the Qspi partition. The requested chunk size (or the default) is rounded
+ * down to a multiple of the erase size when it spans at least one erase
+ * block, otherwise it is rounded up to a multiple of the write size.
+ *
+ * @param	qspi_mtd_info is the MTD info of the partition being written
+ *
+ * @return	Chunk size in bytes
+ *
+ *****************************************************************************/
+static unsigned int get_write_chunk_size(mtd_info_t *qspi_mtd_info)
+{
+	unsigned int chunk = XBIU_WRITE_CHUNK_SIZE;
+	unsigned int writesize = qspi_mtd_info->writesize;
+
+	if (write_chunk_size != 0U)
+		chunk = write_chunk_size;
+
+	if (writesize == 0U)
+		writesize = 1U;
+
+	if ((qspi_mtd_info->erasesize != 0U) &&
+	    (chunk >= qspi_mtd_info->erasesize))
+		chunk -= chunk % qspi_mtd_info->erasesize;
+	else
+		chunk = ((chunk + writesize - 1U) / writesize) * writesize;
+
+	return chunk;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function writes len bytes from buf to fd, retrying on short writes
+ * and on writes interrupted by a signal.
+ *
+ * @param	fd is the file descriptor to write to
+ * @param	buf points to the data to be written
+ * @param	len denotes number of bytes to be written
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int write_full(int fd, char *buf, unsigned int len)
+{
+	ssize_t ret;
+
+	while (len > 0U) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("Write failed: %s\n", strerror(errno));
+			return XST_FAILURE;
+		}
+		if (ret == 0) {
+			printf("Write failed: no progress\n");
+			return XST_FAILURE;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function is the default progress callback. It prints bytes done,
+ * percentage, throughput and estimated time remaining to stderr. On a
+ * terminal the line is refreshed in place, otherwise a line is printed
+ * every XBIU_PROGRESS_STEP percent.
+ *
+ * @param	phase is the name of the operation in progress
+ * @param	done denotes number of bytes processed so far
+ * @param	total denotes total number of bytes to process
+ * @param	elapsed is the time in seconds since the operation started
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void print_progress(const char *phase, unsigned int done,
+			   unsigned int total, double elapsed)
+{
+	static unsigned int last_percent = 101U;
+	static const char *last_phase;
+	unsigned int percent = 100U;
+	double rate = 0.0, eta = 0.0;
+	int tty = isatty(STDERR_FILENO);
+
+	if (total != 0U)
+		percent = (unsigned int)(((unsigned long long)done * 100U) /
+					 total);
+
+	if ((phase == last_phase) && (done != total)) {
+		if (percent == last_percent)
+			return;
+		if (!tty && ((percent / XBIU_PROGRESS_STEP) ==
+			     (last_percent / XBIU_PROGRESS_STEP)))
+			return;
+	}
+	last_phase = phase;
+	last_percent = percent;
+
+	if (elapsed > 0.0) {
+		rate = done / elapsed;
+		if (rate > 0.0)
+			eta = (total - done) / rate;
+	}
+
+	fprintf(stderr, "%s%s: %u/%u bytes (%u%%) %.2f MB/s ETA %.0fs%s",
+		tty ? "\r" : "", phase, done, total, percent, rate / 1000000.0,
+		eta, (tty && (done != total)) ? "" : "\n");
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function returns the monotonic clock in seconds.
+ *
+ * @return	Current monotonic time in seconds
+ *
+ *****************************************************************************/
+static double get_time_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function parses a size given in bytes with an optional K or M suffix.
+ *
+ * @param	str is the string to be parsed
+ * @param	size is a place holder for the parsed size
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int parse_size(const char *str, unsigned int *size)
+{
+	char *end = NULL;
+	unsigned long val, mult = 1UL;
+
+	errno = 0;
+	val = strtoul(str, &end, 0);
+	if ((errno != 0) || (end == str) || (str[0] == '-'))
+		return XST_FAILURE;
+
+	if ((*end == 'K') || (*end == 'k')) {
+		mult = 1024UL;
+		end++;
+	} else if ((*end == 'M') || (*end == 'm')) {
+		mult = 1024UL * 1024UL;
+		end++;
+	}
+
+	if ((*end != '\0') || (val == 0UL) || (val > (0xFFFFFFFFUL / mult)))
+		return XST_FAILURE;
+	val *= mult;
+
+	*size = (unsigned int)val;
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function parses a positive number without a size suffix, such as a
+ * count or a time.
+ *
+ * @param	str is the string to be parsed
+ * @param	val is a place holder for the parsed number
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int parse_number(const char *str, unsigned int *val)
+{
+	char *end = NULL;
+	unsigned long num;
+
+	errno = 0;
+	num = strtoul(str, &end, 0);
+	if ((errno != 0) || (end == str) || (*end != '\0') ||
+	    (str[0] == '-') || (num == 0UL) || (num > 0xFFFFFFFFUL))
+		return XST_FAILURE;
+
+	*val = (unsigned int)num;
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function erases length bytes of the Qspi partition starting at start
+ * one erase block per MEMERASE, so that no single call blocks for the whole
+ * range, and accounts the erase in the per erase block wear counters. The
+ * heartbeat is fed between erase blocks.
+ *
+ * @param	fd is the file descriptor of the Qspi partition
+ * @param	qspi_mtd_file denotes the mtd partition being erased
+ * @param	qspi_mtd_info is the MTD info of the partition
+ * @param	start is the offset of the first byte to erase
+ * @param	length denotes number of bytes to erase
+ *
+ * @return	XST_SUCCESS on SUCCESS and error code on failure
+ *
+ *****************************************************************************/
+static int erase_mtd(int fd, char *qspi_mtd_file, mtd_info_t *qspi_mtd_info,
+		     unsigned int start, unsigned int length)
+{
+	int ret;
+	erase_info_t ei = {0U};
+	unsigned int end = start + length;
+	unsigned int step = qspi_mtd_info->erasesize ?
+		qspi_mtd_info->erasesize : length;
+
+	for (ei.start = start; ei.start < end; ei.start += ei.length) {
+		ei.length = ((end - ei.start) < step) ? (end - ei.start) : step;
+		do {
+			ret = ioctl(fd, MEMERASE, &ei);
+		} while ((ret < 0) && (errno == EINTR));
+		if (ret < 0)
+			return ret;
+
+		wear_record_erase(qspi_mtd_file, qspi_mtd_info, ei.start,
+				  ei.length);
+		heartbeat();
+	}
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function returns the MTD device name (e.g. mtd2) of an MTD path.
+ *
+ * @param	qspi_mtd_file denotes the mtd partition path
+ *
+ * @return	Pointer to the device name within qspi_mtd_file
+ *
+ *****************************************************************************/
+static const char *get_mtd_name(const char *qspi_mtd_file)
+{
+	const char *name = strrchr(qspi_mtd_file, '/');
+
+	return name ? name + 1 : qspi_mtd_file;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function loads the erase counters from XBIU_WEAR_FILE. Each line of
+ * the file holds the device name, erase size, number of erase blocks and one
+ * erase count per block. A missing or malformed file starts from zero.
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void wear_load(void)
+{
+	FILE *fp;
+	struct wear_entry *entry;
+	char dev[XBIU_MTD_NAME_LEN];
+	unsigned int erasesize, nblocks, idx;
+
+	if (wear_loaded)
+		return;
+	wear_loaded = 1;
+
+	fp = fopen(XBIU_WEAR_FILE, "r");
+	if (!fp)
+		return;
+
+	while ((wear_entries < XBIU_WEAR_MAX_DEVS) &&
+	       (fscanf(fp, "%15s %u %u", dev, &erasesize, &nblocks) == 3)) {
+		if ((erasesize == 0U) || (nblocks == 0U))
+			break;
+		entry = &wear_table[wear_entries];
+		entry->count = (unsigned int *)calloc(nblocks,
+						      sizeof(unsigned int));
+		if (!entry->count)
+			break;
+		strcpy(entry->dev, dev);
+		entry->erasesize = erasesize;
+		entry->nblocks = nblocks;
+		for (idx = 0U; idx < nblocks; idx++) {
+			if (fscanf(fp, "%u", &entry->count[idx]) != 1)
+				break;
+		}
+		wear_entries++;
+		if (idx != nblocks)
+			break;
+	}
+
+	fclose(fp);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function stores the erase counters to XBIU_WEAR_FILE. The record is
+ * written to a temporary file which is then renamed over the old record.
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int wear_save(void)
+{
+	FILE *fp;
+	unsigned int entry, idx;
+
+	fp = state_file_create(XBIU_WEAR_FILE ".tmp");
+	if (!fp)
+		return XST_FAILURE;
+
+	for (entry = 0U; entry < wear_entries; entry++) {
+		fprintf(fp, "%s %u %u", wear_table[entry].dev,
+			wear_table[entry].erasesize,
+			wear_table[entry].nblocks);
+		for (idx = 0U; idx < wear_table[entry].nblocks; idx++)
+			fprintf(fp, " %u", wear_table[entry].count[idx]);
+		fprintf(fp, "\n");
+	}
+
+	return state_file_commit(fp, XBIU_WEAR_FILE ".tmp", XBIU_WEAR_FILE);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function stores the erase counters if erases were recorded since they
+ * were last stored. Failing to store the counters does not fail the
+ * operation.
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void wear_flush(void)
+{
+	if (!wear_dirty)
+		return;
+
+	wear_dirty = 0;
+	if (wear_save() != XST_SUCCESS)
+		printf("Storing erase counters failed\n");
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function drops the erase counters held in memory, after storing any
+ * unsaved ones, so that the next access reloads them from XBIU_WEAR_FILE.
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void wear_unload(void)
+{
+	unsigned int idx;
+
+	wear_flush();
+	for (idx = 0U; idx < wear_entries; idx++) {
+		free(wear_table[idx].count);
+		wear_table[idx].count = NULL;
+	}
+	wear_entries = 0U;
+	wear_loaded = 0;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function creates the temporary file that a state record under
+ * XBIU_STATE_DIR is written to before state_file_commit renames it.
+ *
+ * @param	tmp_file is the path of the temporary file
+ *
+ * @return	Pointer to the opened file or NULL on failure
+ *
+ *****************************************************************************/
+static FILE *state_file_create(const char *tmp_file)
+{
+	if ((mkdir(XBIU_STATE_DIR, 0755) != 0) && (errno != EEXIST))
+		return NULL;
+
+	return fopen(tmp_file, "w");
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function flushes and closes a temporary state file and renames it
+ * over the state record, so that the record is never seen half written.
+ *
+ * @param	fp is the temporary file returned by state_file_create
+ * @param	tmp_file is the path of the temporary file
+ * @param	state_file is the path of the state record
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int state_file_commit(FILE *fp, const char *tmp_file,
+			     const char *state_file)
+{
+	int ret = XST_SUCCESS;
+
+	if ((fflush(fp) != 0) || (fsync(fileno(fp)) != 0))
+		ret = XST_FAILURE;
+	if (fclose(fp) != 0)
+		ret = XST_FAILURE;
+	if ((ret == XST_SUCCESS) && (rename(tmp_file, state_file) != 0))
+		ret = XST_FAILURE;
+	if (ret != XST_SUCCESS)
+		unlink(tmp_file);
+
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function reads the counters accumulated over previous runs from
+ * XBIU_METRICS_STATE_FILE. Missing counters start from zero.
+ *
+ * @param	totals is a place holder for the counters
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void metrics_load(struct metrics_totals *totals)
+{
+	FILE *fp;
+	char key[XBIU_METRICS_KEY_LEN];
+	unsigned long long val;
+
+	memset(totals, 0, sizeof(*totals));
+	fp = fopen(XBIU_METRICS_STATE_FILE, "r");
+	if (!fp)
+		return;
+
+	while (fscanf(fp, "%63s %llu", key, &val) == 2) {
+		if (strcmp(key, "runs") == 0)
+			totals->runs = val;
+		else if (strcmp(key, "failures") == 0)
+			totals->failures = val;
+		else if (strcmp(key, "updates") == 0)
+			totals->updates = val;
+		else if (strcmp(key, "verify_failures") == 0)
+			totals->verify_failures = val;
+		else if (strcmp(key, "bytes_written") == 0)
+			totals->bytes_written = val;
+		else if (strcmp(key, "pers_reg_commits") == 0)
+			totals->pers_reg_commits = val;
+		else if (strcmp(key, "last_update") == 0)
+			totals->last_update = val;
+	}
+
+	fclose(fp);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function stores the accumulated counters to XBIU_METRICS_STATE_FILE.
+ *
+ * @param	totals points to the counters
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int metrics_save(struct metrics_totals *totals)
+{
+	FILE *fp;
+
+	fp = state_file_create(XBIU_METRICS_STATE_FILE ".tmp");
+	if (!fp)
+		return XST_FAILURE;
+
+	fprintf(fp, "runs %llu\n", totals->runs);
+	fprintf(fp, "failures %llu\n", totals->failures);
+	fprintf(fp, "updates %llu\n", totals->updates);
+	fprintf(fp, "verify_failures %llu\n", totals->verify_failures);
+	fprintf(fp, "bytes_written %llu\n", totals->bytes_written);
+	fprintf(fp, "pers_reg_commits %llu\n", totals->pers_reg_commits);
+	fprintf(fp, "last_update %llu\n", totals->last_update);
+
+	return state_file_commit(fp, XBIU_METRICS_STATE_FILE ".tmp",
+				 XBIU_METRICS_STATE_FILE);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function prints the HELP and TYPE lines of a metric.
+ *
+ * @param	fp is the metrics file
+ * @param	name is the metric name
+ * @param	type is the metric type
+ * @param	help is the description of the metric
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void metrics_header(FILE *fp, const char *name, const char *type,
+			   const char *help)
+{
+	fprintf(fp, "# HELP %s %s\n", name, help);
+	fprintf(fp, "# TYPE %s %s\n", name, type);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function adds the current run to the accumulated counters and
+ * exports them with the measurements of the run and the persistent state
+ * registers to metrics_file for the node_exporter textfile collector. The
+ * file is written next to metrics_file and renamed over it. A missing
+ * collector directory is only reported when --metrics-file was given.
+ *
+ * @param	operation is the operation performed by the run
+ * @param	result is the exit status of the run
+ * @param	pers_reg_valid is non zero if boot_img_info was read from Qspi
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int metrics_export(const char *operation, int result,
+			  int pers_reg_valid)
+{
+	FILE *fp;
+	struct metrics_totals totals;
+	char tmp_file[XBIU_HTTP_PATH_LEN];
+	unsigned long long now = (unsigned long long)time(NULL);
+	struct sys_persistent_state *state = &boot_img_info.persistent_state;
+	int updated = (result == XST_SUCCESS) &&
+		((strcmp(operation, "update") == 0) ||
+		 (strcmp(operation, "clone") == 0));
+
+	metrics_load(&totals);
+	totals.runs++;
+	if (result != XST_SUCCESS)
+		totals.failures++;
+	if (updated) {
+		totals.updates++;
+		totals.last_update = now;
+	}
+	totals.verify_failures += run_metrics.verify_failures;
+	totals.bytes_written += run_metrics.bytes_written;
+	totals.pers_reg_commits += run_metrics.pers_reg_commits;
+	(void)metrics_save(&totals);
+
+	if (snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", metrics_file) >=
+	    (int)sizeof(tmp_file))
+		return XST_FAILURE;
+	fp = fopen(tmp_file, "w");
+	if (!fp) {
+		if (metrics_file_set)
+			printf("Open metrics file %s failed\n", tmp_file);
+		return XST_FAILURE;
+	}
+
+	metrics_header(fp, "image_update_last_run_timestamp_seconds", "gauge",
+		       "Time the last run finished.");
+	fprintf(fp, "image_update_last_run_timestamp_seconds %llu\n", now);
+	metrics_header(fp, "image_update_last_run_success", "gauge",
+		       "1 if the last run succeeded.");
+	fprintf(fp, "image_update_last_run_success %d\n",
+		result == XST_SUCCESS);
+	metrics_header(fp, "image_update_last_run_info", "gauge",
+		       "Operation performed by the last run.");
+	fprintf(fp, "image_update_last_run_info{operation=\"%s\"} 1\n",
+		operation);
+	metrics_header(fp, "image_update_last_update_timestamp_seconds",
+		       "gauge", "Time of the last successful bank update.");
+	fprintf(fp, "image_update_last_update_timestamp_seconds %llu\n",
+		totals.last_update);
+
+	metrics_header(fp, "image_update_phase_duration_seconds", "gauge",
+		       "Duration of each phase of the last run.");
+	fprintf(fp, "image_update_phase_duration_seconds{phase=\"write\"} %.3f\n",
+		run_metrics.write_sec);
+	fprintf(fp, "image_update_phase_duration_seconds{phase=\"verify\"} %.3f\n",
+		run_metrics.verify_sec);
+	fprintf(fp, "image_update_phase_duration_seconds{phase=\"pers_reg\"} %.3f\n",
+		run_metrics.pers_reg_sec);
+	metrics_header(fp, "image_update_phase_throughput_bytes_per_second",
+		       "gauge", "Qspi throughput of each phase of the last run.");
+	fprintf(fp, "image_update_phase_throughput_bytes_per_second{phase=\"write\"} %.0f\n",
+		(run_metrics.write_sec > 0.0) ?
+		run_metrics.bytes_written / run_metrics.write_sec : 0.0);
+	fprintf(fp, "image_update_phase_throughput_bytes_per_second{phase=\"verify\"} %.0f\n",
+		(run_metrics.verify_sec > 0.0) ?
+		run_metrics.bytes_written / run_metrics.verify_sec : 0.0);
+	metrics_header(fp, "image_update_last_run_written_bytes", "gauge",
+		       "Bytes of image programmed by the last run.");
+	fprintf(fp, "image_update_last_run_written_bytes %u\n",
+		run_metrics.bytes_written);
+	metrics_header(fp, "image_update_last_run_pers_reg_commits", "gauge",
+		       "Persistent register copies written by the last run.");
+	fprintf(fp, "image_update_last_run_pers_reg_commits %u\n",
+		run_metrics.pers_reg_commits);
+
+	if (pers_reg_valid) {
+		metrics_header(fp, "image_update_persistent_state", "gauge",
+			       "Fields of the persistent state registers.");
+		fprintf(fp, "image_update_persistent_state{field=\"last_booted_img\"} %d\n",
+			state->last_booted_img);
+		fprintf(fp, "image_update_persistent_state{field=\"requested_boot_img\"} %d\n",
+			state->requested_boot_img);
+		fprintf(fp, "image_update_persistent_state{field=\"img_a_bootable\"} %d\n",
+			state->img_a_bootable);
+		fprintf(fp, "image_update_persistent_state{field=\"img_b_bootable\"} %d\n",
+			state->img_b_bootable);
+	}
+
+	metrics_header(fp, "image_update_runs_total", "counter",
+		       "Runs of image_update.");
+	fprintf(fp, "image_update_runs_total %llu\n", totals.runs);
+	metrics_header(fp, "image_update_failures_total", "counter",
+		       "Runs of image_update that failed.");
+	fprintf(fp, "image_update_failures_total %llu\n", totals.failures);
+	metrics_header(fp, "image_update_updates_total", "counter",
+		       "Successful bank updates.");
+	fprintf(fp, "image_update_updates_total %llu\n", totals.updates);
+	metrics_header(fp, "image_update_verify_failures_total", "counter",
+		       "Readback checksum mismatches after programming.");
+	fprintf(fp, "image_update_verify_failures_total %llu\n",
+		totals.verify_failures);
+	metrics_header(fp, "image_update_written_bytes_total", "counter",
+		       "Bytes of image programmed.");
+	fprintf(fp, "image_update_written_bytes_total %llu\n",
+		totals.bytes_written);
+	metrics_header(fp, "image_update_pers_reg_commits_total", "counter",
+		       "Persistent register copies written.");
+	fprintf(fp, "image_update_pers_reg_commits_total %llu\n",
+		totals.pers_reg_commits);
+
+	if (state_file_commit(fp, tmp_file, metrics_file) != XST_SUCCESS) {
+		printf("Write metrics file %s failed\n", metrics_file);
+		return XST_FAILURE;
+	}
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function returns the erase counters of dev, creating them if the
+ * device is not yet tracked. Counters whose geometry no longer matches the
+ * partition are restarted.
+ *
+ * @param	dev is the MTD device name
+ * @param	qspi_mtd_info is the MTD info of the partition
+ *
+ * @return	Pointer to the entry or NULL on failure
+ *
+ *****************************************************************************/
+static struct wear_entry *wear_get_entry(const char *dev,
+					 mtd_info_t *qspi_mtd_info)
+{
+	struct wear_entry *entry = NULL;
+	unsigned int idx, nblocks;
+
+	if ((qspi_mtd_info->erasesize == 0U) ||
+	    (strlen(dev) >= XBIU_MTD_NAME_LEN))
+		return NULL;
+	nblocks = qspi_mtd_info->size / qspi_mtd_info->erasesize;
+
+	wear_load();
+	for (idx = 0U; idx < wear_entries; idx++) {
+		if (strcmp(wear_table[idx].dev, dev) == 0) {
+			entry = &wear_table[idx];
+			break;
+		}
+	}
+
+	if (!entry) {
+		if (wear_entries == XBIU_WEAR_MAX_DEVS)
+			return NULL;
+		entry = &wear_table[wear_entries++];
+		strcpy(entry->dev, dev);
+	} else if ((entry->erasesize == qspi_mtd_info->erasesize) &&
+		   (entry->nblocks == nblocks)) {
+		return entry;
+	}
+
+	free(entry->count);
+	entry->count = (unsigned int *)calloc(nblocks, sizeof(unsigned int));
+	entry->erasesize = qspi_mtd_info->erasesize;
+	entry->nblocks = entry->count ? nblocks : 0U;
+
+	return entry->count ? entry : NULL;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function increments the erase counters of all erase blocks covered by
+ * an erase. The counters are kept in memory until wear_flush stores them at
+ * the end of the operation. It warns when an erase block of the persistent
+ * register partitions crosses the wear threshold.
+ *
+ * @param	qspi_mtd_file denotes the mtd partition that was erased
+ * @param	qspi_mtd_info is the MTD info of the partition
+ * @param	start is the offset of the first erased byte
+ * @param	length denotes number of erased bytes
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void wear_record_erase(char *qspi_mtd_file, mtd_info_t *qspi_mtd_info,
+			      unsigned int start, unsigned int length)
+{
+	const char *dev = get_mtd_name(qspi_mtd_file);
+	struct wear_entry *entry = wear_get_entry(dev, qspi_mtd_info);
+	unsigned int blk, end;
+
+	if (!entry)
+		return;
+
+	end = (start + length + entry->erasesize - 1U) / entry->erasesize;
+	for (blk = start / entry->erasesize;
+	     (blk < end) && (blk < entry->nblocks); blk++)
+		entry->count[blk]++;
+	wear_dirty = 1;
+
+	if (((strcmp(dev, "mtd2") == 0) || (strcmp(dev, "mtd3") == 0)) &&
+	    (wear_get_max(entry) >= wear_threshold))
+		printf("Warning: persistent register partition %s is past %u erase cycles\n",
+		       qspi_mtd_file, wear_threshold);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function returns the highest erase count of an MTD partition.
+ *
+ * @param	entry is the erase counter entry of the partition
+ *
+ * @return	Highest erase count of any erase block
+ *
+ *****************************************************************************/
+static unsigned int wear_get_max(struct wear_entry *entry)
+{
+	unsigned int idx, max = 0U;
+
+	for (idx = 0U; idx < entry->nblocks; idx++) {
+		if (entry->count[idx] > max)
+			max = entry->count[idx];
+	}
+
+	return max;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function prints the erase counters of all tracked MTD partitions and
+ * warns about persistent register partitions past the wear threshold.
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void print_wear_info(void)
+{
+	unsigned int entry, idx, max;
+	unsigned long long total;
+
+	wear_load();
+	if (wear_entries == 0U)
+		return;
+
+	printf("Erase Counts:\n");
+	for (entry = 0U; entry < wear_entries; entry++) {
+		total = 0U;
+		for (idx = 0U; idx < wear_table[entry].nblocks; idx++)
+			total += wear_table[entry].count[idx];
+		max = wear_get_max(&wear_table[entry]);
+		printf("  /dev/%s: max %u, total %llu over %u blocks\n",
+		       wear_table[entry].dev, max, total,
+		       wear_table[entry].nblocks);
+		if (((strcmp(wear_table[entry].dev, "mtd2") == 0) ||
+		     (strcmp(wear_table[entry].dev, "mtd3") == 0)) &&
+		    (max >= wear_threshold))
+			printf("  Warning: /dev/%s is past the wear threshold of %u erase cycles\n",
+			       wear_table[entry].dev, wear_threshold);
+	}
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function calculates checksum of len bytes of data starting from srcaddr
+ * and stores it in calc_crc.
+ *
+ * @param	srcaddr points to the start of data
+ * @param	len denotes number of bytes of data
+ * @param	calc_crc is a place holder for the calculated checksum
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void calculate_image_checksum(char *srcaddr, unsigned int len,
+				     unsigned int *calc_crc)
+{
+	unsigned int idx;
+
+	for (idx = 0U; idx < len; idx++) {
+		*calc_crc = ((*calc_crc) >> 8U) ^
+			crc_table[((*calc_crc) ^ srcaddr[idx]) & 0xFFU];
+	}
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function multiplies two polynomials modulo the CRC polynomial, both
+ * in the bit reflected representation used by crc_table.
+ *
+ * @param	a is the first polynomial, must not be 0
+ * @param	b is the second polynomial
+ *
+ * @return	a * b modulo the CRC polynomial
+ *
+ *****************************************************************************/
+static unsigned int crc_multmodp(unsigned int a, unsigned int b)
+{
+	unsigned int m = 1U << 31U;
+	unsigned int p = 0U;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1U)) == 0U)
+				break;
+		}
+		m >>= 1U;
+		b = (b & 1U) ? ((b >> 1U) ^ XBIU_CRC_POLY) : (b >> 1U);
+	}
+
+	return p;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function advances a checksum over len zero bytes, i.e. multiplies it
+ * by x^(8 * len) modulo the CRC polynomial. Since the checksum is linear,
+ * the checksum of A followed by B equals crc_shift(crc(A), len(B)) XORed
+ * with the checksum of B started from 0.
+ *
+ * @param	crc is the checksum to be advanced
+ * @param	len denotes number of bytes to advance by
+ *
+ * @return	Advanced checksum
+ *
+ *****************************************************************************/
+static unsigned int crc_shift(unsigned int crc, unsigned int len)
+{
+	unsigned int p = 1U << 31U;
+	unsigned int x2n = 1U << 23U;
+
+	/* p = x^(8 * len) by square and multiply, starting from x^8 */
+	while (len != 0U) {
+		if (len & 1U)
+			p = crc_multmodp(x2n, p);
+		x2n = crc_multmodp(x2n, x2n);
+		len >>= 1U;
+	}
+
+	return crc_multmodp(p, crc);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function checksums one segment of calculate_checksum_parallel by
+ * reading it from a file descriptor into a pool buffer.
+ *
+ * @param	arg points to the crc_job
+ *
+ * @return	NULL
+ *
+ *****************************************************************************/
+static void *crc_worker(void *arg)
+{
+	struct crc_job *job = (struct crc_job *)arg;
+	unsigned int off, cur;
+	char *buf;
+
+	job->ret = XST_SUCCESS;
+	buf = pool_get(XBIU_WRITE_CHUNK_SIZE);
+	if (!buf) {
+		job->ret = XST_FAILURE;
+		return NULL;
+	}
+	for (off = 0U; off < job->len; off += cur) {
+		cur = job->len - off;
+		if (cur > XBIU_WRITE_CHUNK_SIZE)
+			cur = XBIU_WRITE_CHUNK_SIZE;
+		if (cancel_requested || (read_full(job->fd, buf,
+						   job->base + off, cur) !=
+					 (int)cur)) {
+			job->ret = XST_FAILURE;
+			break;
+		}
+		calculate_image_checksum(buf, cur, &job->crc);
+		if (job->heartbeat)
+			heartbeat();
+	}
+	pool_put(buf);
+
+	return NULL;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function calculates the same checksum as calculate_image_checksum,
+ * splitting data of at least XBIU_CRC_PARALLEL_MIN bytes into one segment
+ * per online CPU. Segments are checksummed concurrently and merged with
+ * crc_shift.
+ *
+ * @param	fd is the file descriptor to read the data from
+ * @param	base is the offset of the data in fd
+ * @param	len denotes number of bytes of data
+ * @param	calc_crc is the initial checksum and a place holder for the
+ *		calculated checksum
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int calculate_checksum_parallel(int fd, unsigned int base,
+				       unsigned int len,
+				       unsigned int *calc_crc)
+{
+	struct crc_job job[XBIU_CRC_MAX_THREADS];
+	pthread_t thread[XBIU_CRC_MAX_THREADS];
+	int started[XBIU_CRC_MAX_THREADS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int nthreads, idx, seg;
+	unsigned int crc;
+	int ret = XST_SUCCESS;
+
+	nthreads = XBIU_CRC_MAX_THREADS;
+	if (cpus < (long)XBIU_CRC_MAX_THREADS)
+		nthreads = (cpus > 1L) ? (unsigned int)cpus : 1U;
+	if (len < XBIU_CRC_PARALLEL_MIN)
+		nthreads = 1U;
+
+	seg = len / nthreads;
+	for (idx = 0U; idx < nthreads; idx++) {
+		job[idx].fd = fd;
+		job[idx].base = base + (idx * seg);
+		job[idx].len = (idx == (nthreads - 1U)) ?
+			(len - (idx * seg)) : seg;
+		job[idx].crc = (idx == 0U) ? *calc_crc : 0U;
+		job[idx].heartbeat = 0;
+		started[idx] = (idx != 0U) &&
+			(pthread_create(&thread[idx], NULL, crc_worker,
+					&job[idx]) == 0);
+	}
+
+	/* The calling thread takes the first segment and any segment whose
+	 * thread could not be started, feeding the heartbeat meanwhile
+	 */
+	for (idx = 0U; idx < nthreads; idx++) {
+		if (!started[idx]) {
+			job[idx].heartbeat = 1;
+			crc_worker(&job[idx]);
+		}
+	}
+
+	crc = job[0U].crc;
+	for (idx = 0U; idx < nthreads; idx++) {
+		if (started[idx])
+			pthread_join(thread[idx], NULL);
+		if (job[idx].ret != XST_SUCCESS)
+			ret = XST_FAILURE;
+		if (idx != 0U)
+			crc = crc_shift(crc, job[idx].len) ^ job[idx].crc;
+	}
+	*calc_crc = crc;
+
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function allocates the buffer pool, sized for the largest erase block
+ * of the image banks, and locks it in memory so that an update neither
+ * allocates memory nor takes page faults once it is running. The update
+ * continues with an unlocked pool when locking is not permitted.
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int pool_init(void)
+{
+	char *bank_mtd_file[] = {"/dev/mtd5", "/dev/mtd7"};
+	unsigned int block_size = XBIU_WRITE_CHUNK_SIZE;
+	unsigned int idx;
+	mtd_info_t qspi_mtd_info;
+	size_t size;
+	void *addr;
+	int fd;
+
+	if (buf_pool.base)
+		return XST_SUCCESS;
+
+	for (idx = 0U; idx < 2U; idx++) {
+		fd = open(bank_mtd_file[idx], O_RDONLY);
+		if (fd < 0)
+			continue;
+		if ((ioctl(fd, MEMGETINFO, &qspi_mtd_info) == XST_SUCCESS) &&
+		    (qspi_mtd_info.erasesize > block_size))
+			block_size = qspi_mtd_info.erasesize;
+		close(fd);
+	}
+
+	size = (size_t)block_size * XBIU_POOL_BUFS;
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		printf("Allocation of buffer pool failed\n");
+		return XST_FAILURE;
+	}
+	if (mlock(addr, size) != 0)
+		printf("Locking buffer pool failed: %s\n", strerror(errno));
+	/* Fault the pool in now rather than during the update */
+	memset(addr, 0xFF, size);
+
+	buf_pool.base = (char *)addr;
+	buf_pool.block_size = block_size;
+	buf_pool.in_use = 0U;
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function takes a free buffer of the buffer pool.
+ *
+ * @param	size denotes the number of bytes needed
+ *
+ * @return	Pointer to the buffer or NULL if size exceeds the buffer size
+ *		or no buffer is free
+ *
+ *****************************************************************************/
+static char *pool_get(unsigned int size)
+{
+	char *buf = NULL;
+	unsigned int idx;
+
+	if (!buf_pool.base || (size > buf_pool.block_size))
+		return NULL;
+
+	pthread_mutex_lock(&buf_pool.lock);
+	for (idx = 0U; idx < XBIU_POOL_BUFS; idx++) {
+		if (!(buf_pool.in_use & (1U << idx))) {
+			buf_pool.in_use |= 1U << idx;
+			buf = buf_pool.base + ((size_t)idx *
+					       buf_pool.block_size);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&buf_pool.lock);
+
+	return buf;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function returns a buffer taken with pool_get to the buffer pool.
+ *
+ * @param	buf points to the buffer, may be NULL
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void pool_put(char *buf)
+{
+	unsigned int idx;
+
+	if (!buf)
+		return;
+
+	idx = (unsigned int)((buf - buf_pool.base) / buf_pool.block_size);
+	pthread_mutex_lock(&buf_pool.lock);
+	buf_pool.in_use &= ~(1U << idx);
+	pthread_mutex_unlock(&buf_pool.lock);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function shields the process from the OOM killer while the banks and
+ * persistent registers are written, and restores the previous
+ * oom_score_adj afterwards.
+ *
+ * @param	enable is non zero to protect the process, 0 to restore
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void oom_protect(int enable)
+{
+	if (enable) {
+		if (oom_score_adj_saved[0U] != '\0')
+			return;
+		if (sysfs_read(XBIU_OOM_SCORE_ADJ_FILE, oom_score_adj_saved,
+			       sizeof(oom_score_adj_saved)) != XST_SUCCESS)
+			return;
+		if (sysfs_write(XBIU_OOM_SCORE_ADJ_FILE,
+				XBIU_OOM_SCORE_ADJ_MIN) != XST_SUCCESS)
+			oom_score_adj_saved[0U] = '\0';
+	} else if (oom_score_adj_saved[0U] != '\0') {
+		(void)sysfs_write(XBIU_OOM_SCORE_ADJ_FILE,
+				  oom_score_adj_saved);
+		oom_score_adj_saved[0U] = '\0';
+	}
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function is the SIGINT and SIGTERM handler. It only flags the
+ * request; bank writes stop at the next erase block boundary while
+ * persistent register commits always complete.
+ *
+ * @param	sig is the signal received
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void handle_cancel(int sig)
+{
+	(void)sig;
+	cancel_requested = 1;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function installs handle_cancel for SIGINT and SIGTERM. Blocking
+ * calls are not restarted so that waits for the image source return early.
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void install_cancel_handler(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_cancel;
+	sigemptyset(&sa.sa_mask);
+	(void)sigaction(SIGINT, &sa, NULL);
+	(void)sigaction(SIGTERM, &sa, NULL);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function checks whether the operation has been cancelled by a signal
+ * and reports it the first time.
+ *
+ * @return	1 if cancelled and 0 otherwise
+ *
+ *****************************************************************************/
+static int operation_cancelled(void)
+{
+	static int reported;
+
+	if (!cancel_requested)
+		return 0;
+
+	if (!reported) {
+		printf("Cancelled at an erase block boundary\n");
+		reported = 1;
+	}
+
+	return 1;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function opens the file or watchdog device fed by heartbeat. A
+ * watchdog device is never closed with the magic character, so it keeps
+ * running once image_update exits.
+ *
+ * @param	heartbeat_file is the path of the heartbeat file or device
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int heartbeat_open(const char *heartbeat_file)
+{
+	struct stat details;
+
+	heartbeat_fd = open(heartbeat_file, O_WRONLY | O_CREAT | O_NONBLOCK,
+			    0644);
+	if ((heartbeat_fd < 0) || (fstat(heartbeat_fd, &details) != 0)) {
+		printf("Open heartbeat %s failed: %s\n", heartbeat_file,
+		       strerror(errno));
+		return XST_FAILURE;
+	}
+	heartbeat_seekable = S_ISREG(details.st_mode);
+	heartbeat();
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function feeds the heartbeat between Qspi units of work, at most
+ * once every XBIU_HEARTBEAT_MS. A heartbeat file is rewritten in place so
+ * that its modification time advances; a device gets one byte per beat.
+ * It may be called from any thread, a beat already in progress on another
+ * thread counts for the caller.
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void heartbeat(void)
+{
+	double now;
+	ssize_t ret;
+
+	if ((heartbeat_fd < 0) || (pthread_mutex_trylock(&heartbeat_lock) != 0))
+		return;
+
+	now = get_time_sec();
+	if (((now - heartbeat_last) * 1000.0) >= XBIU_HEARTBEAT_MS) {
+		heartbeat_last = now;
+		if (heartbeat_seekable)
+			ret = pwrite(heartbeat_fd, "1", 1U, 0);
+		else
+			ret = write(heartbeat_fd, "1", 1U);
+		(void)ret;
+	}
+	pthread_mutex_unlock(&heartbeat_lock);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function ends one erase block sized unit of a bank write. It feeds
+ * the heartbeat and fails the write when the unit took longer than
+ * unit_timeout milliseconds or a cancel has been requested.
+ *
+ * @param	unit_start is the time the unit started
+ * @param	off is the offset of the erase block in the partition
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int bank_unit_end(double unit_start, unsigned int off)
+{
+	double elapsed_ms = (get_time_sec() - unit_start) * 1000.0;
+
+	heartbeat();
+	if ((unit_timeout != 0U) && (elapsed_ms > unit_timeout)) {
+		printf("Erase block at 0x%08x took %.0f ms, over the %u ms limit\n",
+		       off, elapsed_ms, unit_timeout);
+		return XST_FAILURE;
+	}
+
+	return operation_cancelled() ? XST_FAILURE : XST_SUCCESS;
+}
 
-		ret = read(fd, read_buffer, len);
-		if (ret != len) {
-			printf("Qspi checksum calculation failed\n");
-			ret = XST_FAILURE;
+/*****************************************************************************/
+/**
+ * @brief
+ * This function waits on the stream ring for at most XBIU_HEARTBEAT_MS and
+ * feeds the heartbeat, so that a stalled image source neither starves the
+ * heartbeat nor delays a cancel. It is called with the ring locked.
+ *
+ * @param	ring is the stream ring
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void ring_wait(struct stream_ring *ring)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += (long)XBIU_HEARTBEAT_MS * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	(void)pthread_cond_timedwait(&ring->cond, &ring->lock, &ts);
+	heartbeat();
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function waits until fd is readable. While stream_image runs, the
+ * wait also ends when stream_image stops the stream, so that its reader
+ * thread never stays blocked on a stalled pipe or socket.
+ *
+ * @param	fd is the file descriptor to wait for
+ * @param	timeout_ms is the longest wait in milliseconds, -1 for none
+ *
+ * @return	XST_SUCCESS if fd is readable and XST_FAILURE if the stream
+ *		was stopped, cancelled or the wait timed out
+ *
+ *****************************************************************************/
+static int wait_readable(int fd, int timeout_ms)
+{
+	struct pollfd pfd[2U];
+	int ret;
+
+	pfd[0U].fd = fd;
+	pfd[0U].events = POLLIN;
+	pfd[1U].fd = stream_stop_fd[0U];
+	pfd[1U].events = POLLIN;
+	do {
+		pfd[0U].revents = 0;
+		pfd[1U].revents = 0;
+		ret = poll(pfd, 2U, timeout_ms);
+	} while ((ret < 0) && (errno == EINTR) && !cancel_requested);
+
+	if ((ret <= 0) || (pfd[1U].revents != 0))
+		return XST_FAILURE;
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function waits up to timeout_ms for stream_image to stop the stream.
+ *
+ * @param	timeout_ms is the longest wait in milliseconds
+ *
+ * @return	1 if the stream was stopped and 0 otherwise
+ *
+ *****************************************************************************/
+static int stream_stopped(int timeout_ms)
+{
+	struct pollfd pfd;
+
+	if (stream_stop_fd[0U] < 0) {
+		if (timeout_ms > 0)
+			usleep((useconds_t)timeout_ms * 1000U);
+		return 0;
+	}
+
+	pfd.fd = stream_stop_fd[0U];
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return (poll(&pfd, 1U, timeout_ms) > 0) && (pfd.revents != 0);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function reads a numeric attribute (e.g. offset or size) of an MTD
+ * device from sysfs.
+ *
+ * @param	idx is the number of the MTD device
+ * @param	attr is the name of the attribute
+ * @param	val is a place holder for the attribute value
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int mtd_sysfs_attr(unsigned int idx, const char *attr,
+			  unsigned long long *val)
+{
+	char path[XBIU_MTD_SYSFS_PATH_LEN];
+	char buf[XBIU_CONFIG_REG_BUF_SIZE];
+	char *end;
+
+	snprintf(path, sizeof(path), XBIU_MTD_SYSFS_DIR "/mtd%u/%s", idx,
+		 attr);
+	if (sysfs_read(path, buf, sizeof(buf)) != XST_SUCCESS)
+		return XST_FAILURE;
+
+	errno = 0;
+	*val = strtoull(buf, &end, 0);
+	if ((errno != 0) || (end == buf))
+		return XST_FAILURE;
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function resolves a flash offset to the MTD device holding the image
+ * at that offset. An MTD partition starting at the offset is preferred.
+ * Otherwise the image is located by offset within the whole-flash MTD
+ * device, and the region extends to the next partition or the end of the
+ * flash. An offset inside another partition is rejected, as writing the
+ * region would overwrite that partition.
+ *
+ * @param	offset is the offset of the image in the flash
+ * @param	region is a place holder for the resolved image region
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int resolve_image_region(unsigned int offset,
+				struct image_region *region)
+{
+	unsigned long long part_offset, part_size, end;
+	unsigned long long flash_size = 0U;
+	unsigned int idx, flash_idx = 0U, covering = 0U;
+
+	end = ~0ULL;
+	for (idx = 0U; idx < XBIU_MTD_MAX_DEVS; idx++) {
+		if ((mtd_sysfs_attr(idx, "offset", &part_offset) !=
+		     XST_SUCCESS) ||
+		    (mtd_sysfs_attr(idx, "size", &part_size) != XST_SUCCESS))
+			continue;
+
+		if ((part_offset == offset) && (part_size != 0U) &&
+		    (part_size <= 0xFFFFFFFFULL)) {
+			snprintf(region->mtd_file, sizeof(region->mtd_file),
+				 "/dev/mtd%u", idx);
+			region->base = 0U;
+			region->size = (unsigned int)part_size;
+			return XST_SUCCESS;
+		}
+
+		/* The whole-flash device is the largest one at offset 0 */
+		if ((part_offset == 0U) && (part_size > flash_size)) {
+			flash_size = part_size;
+			flash_idx = idx;
+		}
+		if ((part_offset > offset) && (part_offset < end))
+			end = part_offset;
+		/* Partitions holding the offset, the whole-flash one included */
+		if ((part_offset < offset) &&
+		    ((part_offset + part_size) > offset))
+			covering++;
+	}
+
+	if (covering > 1U) {
+		printf("Flash offset 0x%x lies inside an MTD partition\n",
+		       offset);
+		return XST_FAILURE;
+	}
+
+	if (flash_size > end)
+		flash_size = end;
+	if ((flash_size <= offset) ||
+	    ((flash_size - offset) > 0xFFFFFFFFULL)) {
+		printf("No MTD device holds flash offset 0x%x\n", offset);
+		return XST_FAILURE;
+	}
+
+	snprintf(region->mtd_file, sizeof(region->mtd_file), "/dev/mtd%u",
+		 flash_idx);
+	region->base = offset;
+	region->size = (unsigned int)(flash_size - offset);
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function resolves the region of the recovery image from the
+ * recovery_img_offset of the persistent registers. A region that would
+ * overlap an image bank or a persistent register partition is rejected.
+ *
+ * @param	region is a place holder for the resolved image region
+ *
+ * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int resolve_recovery_region(struct image_region *region)
+{
+	unsigned long long start = boot_img_info.recovery_img_offset;
+	const char *dev;
+
+	if (start == 0U) {
+		printf("Recovery image offset is not set\n");
+		return XST_FAILURE;
+	}
+
+	if (resolve_image_region(boot_img_info.recovery_img_offset,
+				 region) != XST_SUCCESS)
+		return XST_FAILURE;
+
+	/* Never resolve to the image banks or the persistent registers */
+	dev = get_mtd_name(region->mtd_file);
+	if ((strcmp(dev, "mtd2") == 0) || (strcmp(dev, "mtd3") == 0) ||
+	    (strcmp(dev, "mtd5") == 0) || (strcmp(dev, "mtd7") == 0) ||
+	    ((boot_img_info.boot_img_a_offset >= start) &&
+	     (boot_img_info.boot_img_a_offset < (start + region->size))) ||
+	    ((boot_img_info.boot_img_b_offset >= start) &&
+	     (boot_img_info.boot_img_b_offset < (start + region->size)))) {
+		printf("Recovery image region overlaps ImageA, ImageB or the persistent registers\n");
+		return XST_FAILURE;
+	}
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function prints the flash offsets of the images and the location and
+ * revision of the recovery image. A recovery image that cannot be located
+ * is reported without failing.
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void print_recovery_status(void)
+{
+	struct image_region region;
+
+	printf("Image Offsets: ImageA 0x%08X ImageB 0x%08X Recovery 0x%08X\n",
+	       boot_img_info.boot_img_a_offset,
+	       boot_img_info.boot_img_b_offset,
+	       boot_img_info.recovery_img_offset);
+
+	if (resolve_recovery_region(&region) != XST_SUCCESS)
+		return;
+
+	printf("Recovery Image: %s offset 0x%x size 0x%x\n", region.mtd_file,
+	       region.base, region.size);
+	(void)print_image_rev_info(region.mtd_file, region.base, "Recovery");
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function verifies the full checksum of the recovery image. The image
+ * length is taken from the image manifest when the recovery image was written
+ * by image_update, otherwise from its boot and partition headers.
+ *
+ * @return	XST_SUCCESS if the recovery image is valid and XST_FAILURE
+ *		otherwise
+ *
+ *****************************************************************************/
+static int verify_recovery(void)
+{
+	struct image_region region;
+	struct manifest_entry *entry;
+	unsigned int len, crc = 0xFFFFFFFFU;
+	int fd, ret = XST_FAILURE;
+
+	if (resolve_recovery_region(&region) != XST_SUCCESS)
+		return ret;
+
+	fd = open(region.mtd_file, O_RDONLY);
+	if (fd < 0) {
+		printf("Open Qspi MTD partition failed\n");
+		return ret;
+	}
+
+	printf("Verifying recovery image at %s offset 0x%x\n",
+	       region.mtd_file, region.base);
+	if (get_boot_image_length(fd, region.base, region.size, &len) !=
+	    XST_SUCCESS) {
+		printf("Recovery image header is invalid\n");
+		goto END;
+	}
+
+	entry = manifest_lookup(region.mtd_file, region.base);
+	if (entry) {
+		if (entry->len > region.size) {
+			printf("Recovery image manifest is invalid\n");
 			goto END;
 		}
-		calculate_image_checksum(read_buffer, len,
-					 &qspi_image_checksum);
-		image_size -= len;
+		len = entry->len;
 	}
-	if (input_image_checksum != qspi_image_checksum) {
-		printf("checksum mismatch!! Image update failed.\n");
+
+	if (calculate_checksum_parallel(fd, region.base, len, &crc) !=
+	    XST_SUCCESS) {
+		if (!operation_cancelled())
+			printf("Qspi checksum calculation failed\n");
 		goto END;
 	}
-	ret = XST_SUCCESS;
+
+	if (!entry) {
+		printf("Recovery image length 0x%x checksum 0x%08x, no manifest\n",
+		       len, crc);
+		ret = XST_SUCCESS;
+	} else if (crc != entry->crc) {
+		printf("Recovery image checksum mismatch\n");
+		run_metrics.verify_failures++;
+	} else {
+		printf("Recovery image length 0x%x checksum OK\n", len);
+		ret = XST_SUCCESS;
+	}
 
 END:
 	close(fd);
@@ -631,48 +4928,59 @@ END:
 /*****************************************************************************/
 /**
  * @brief
- * This function calculates checksum of len bytes of data starting from srcaddr
- * and stores it in calc_crc.
+ * This function writes the input image, or the running bank, to the
+ * recovery image region with the same streaming engine as a bank update.
+ * The persistent registers are not changed.
  *
- * @param	srcaddr points to the start of data
- * @param	len denotes number of bytes of data
- * @param	calc_crc is a place holder for the calculated checksum
+ * @param	src_mtd_file denotes the running bank to be cloned, NULL to
+ *		write the input image
+ * @param	url_flag is 1 when the input image is an HTTP URL
  *
- * @return	None
+ * @return	XST_SUCCESS on SUCCESS and error code on failure
  *
  *****************************************************************************/
-static void calculate_image_checksum(char *srcaddr, unsigned int len,
-				     unsigned int *calc_crc)
+static int update_recovery(char *src_mtd_file, int url_flag)
 {
-	unsigned int idx;
+	struct image_region region;
 
-	for (idx = 0U; idx < len; idx++) {
-		*calc_crc = ((*calc_crc) >> 8U) ^
-			crc_table[((*calc_crc) ^ srcaddr[idx]) & 0xFFU];
-	}
+	if (resolve_recovery_region(&region) != XST_SUCCESS)
+		return XST_FAILURE;
+
+	printf("Writing recovery image to %s offset 0x%x\n", region.mtd_file,
+	       region.base);
+	if (src_mtd_file)
+		return clone_image(src_mtd_file, region.mtd_file, region.base,
+				   region.size);
+	if (url_flag == 1)
+		return update_image_url(region.mtd_file, region.base,
+					region.size);
+
+	return update_image(region.mtd_file, region.base, region.size);
 }
 
 /*****************************************************************************/
 /**
  * @brief
  * This function checks for identification string and validates checksum of
- * boot_img_info, which at the point of calling this function is populated with
+ * info, which at the point of calling this function is populated with
  * values of persistent registers.
  *
+ * @param	info points to the persistent registers to be validated
+ *
  * @return	XST_SUCCESS on success and error code on failure
  *
  *****************************************************************************/
-static int validate_boot_img_info(void)
+static int validate_boot_img_info(struct sys_boot_img_info *info)
 {
 	int ret = XST_FAILURE;
-	unsigned int checksum = boot_img_info.checksum;
-
-	if ((boot_img_info.idstr[0U] == 'A') &&
-	    (boot_img_info.idstr[1U] == 'B') &&
-		(boot_img_info.idstr[2U] == 'U') &&
-		(boot_img_info.idstr[3U] == 'M')) {
-		boot_img_info.checksum = calculate_checksum();
-		if (checksum == boot_img_info.checksum)
+	unsigned int checksum = info->checksum;
+
+	if ((info->idstr[0U] == 'A') &&
+	    (info->idstr[1U] == 'B') &&
+		(info->idstr[2U] == 'U') &&
+		(info->idstr[3U] == 'M')) {
+		info->checksum = calculate_checksum(info);
+		if (checksum == info->checksum)
 			ret = XST_SUCCESS;
 	}
 
@@ -682,9 +4990,10 @@ static int validate_boot_img_info(void)
 /*****************************************************************************/
 /**
  * @brief
- * This function tries to reads persistent state from backup
- * persistent partition, if it fails to read from main persistent
- * partition
+ * This function reads both main and backup persistent partitions and
+ * loads boot_img_info from the main copy, or from the backup copy if the
+ * main copy is corrupted. The content of both copies is remembered so that
+ * update_persistent_registers only rewrites copies that differ.
  *
  * @return	XST_SUCCESS on SUCCESS and XST_FAILURE on failure
  *
@@ -692,31 +5001,41 @@ static int validate_boot_img_info(void)
 static int read_persistent_register(void)
 {
 	int ret = XST_FAILURE;
+	unsigned int idx;
 
-	ret = read_mtd_part("/dev/mtd2");
-	if (ret != XST_SUCCESS) {
-		printf("Reading persistent registers backup\n");
-		ret = read_mtd_part("/dev/mtd3");
-		if (ret != XST_SUCCESS) {
-			printf("Unable to retrieve persistent registers\n");
+	for (idx = 0U; idx < 2U; idx++) {
+		if ((idx == 1U) && !pers_reg_flash_valid[0U])
+			printf("Reading persistent registers backup\n");
+		pers_reg_flash_valid[idx] =
+			(read_mtd_part(pers_reg_mtd_file[idx],
+				       &pers_reg_flash[idx]) == XST_SUCCESS);
+		if (pers_reg_flash_valid[idx] && (ret != XST_SUCCESS)) {
+			boot_img_info = pers_reg_flash[idx];
+			ret = XST_SUCCESS;
 		}
 	}
 
+	if (ret != XST_SUCCESS) {
+		printf("Unable to retrieve persistent registers\n");
+	}
+
 	return ret;
 }
 
 /*****************************************************************************/
 /**
  * @brief
- * This function loads persistent register status in to boot_img_info
- * structure and validates it.
+ * This function loads persistent register status in to info structure
+ * and validates it.
  *
  * @param	qspi_mtd_file denotes the mtd partition to be read
+ * @param	info is a place holder for the persistent registers
  *
  * @return	XST_SUCCESS on SUCCESS and error code on failure
  *
  *****************************************************************************/
-static int read_mtd_part(char *qspi_mtd_file)
+static int read_mtd_part(char *qspi_mtd_file,
+			 struct sys_boot_img_info *info)
 {
 	int fd_mtd_part, ret = XST_FAILURE;
 
@@ -726,14 +5045,14 @@ static int read_mtd_part(char *qspi_mtd_file)
 		return ret;
 	}
 
-	ret = read(fd_mtd_part, (char *)&boot_img_info, sizeof(boot_img_info));
-	if (ret != sizeof(boot_img_info)) {
+	ret = read(fd_mtd_part, (char *)info, sizeof(*info));
+	if (ret != sizeof(*info)) {
 		printf("Read Qspi MTD partition failed\n");
 		ret = XST_FAILURE;
 		goto END;
 	}
 
-	ret = validate_boot_img_info();
+	ret = validate_boot_img_info(info);
 	if (ret != XST_SUCCESS) {
 		printf("Persistent registers are corrupted\n");
 		goto END;
@@ -809,12 +5128,14 @@ static void print_persistent_status(void)
  * This function reads qspi mtd partition and prints Qspi MFG info.
  *
  * @param	qspi_mtd_file denotes the mtd partition to be read
- * @param	image_name is the string denoting ImageA or ImageB
+ * @param	base is the offset of the image in the partition
+ * @param	image_name is the string denoting ImageA, ImageB or Recovery
  *
  * @return	XST_SUCCESS on SUCCESS and error code on failure
  *
  *****************************************************************************/
-static int print_image_rev_info(char *qspi_mtd_file, char *image_name)
+static int print_image_rev_info(char *qspi_mtd_file, unsigned int base,
+				char *image_name)
 {
 	int fd, ret = XST_FAILURE;
 	char image_rev_info[XBIU_IMG_REVISON_SIZE + 1U] = {0};
@@ -825,9 +5146,10 @@ static int print_image_rev_info(char *qspi_mtd_file, char *image_name)
 		return ret;
 	}
 
-	ret = lseek(fd, XBIU_IMG_REVISON_OFFSET, SEEK_SET);
-	if (ret != XBIU_IMG_REVISON_OFFSET) {
+	if (lseek(fd, (off_t)base + XBIU_IMG_REVISON_OFFSET, SEEK_SET) !=
+	    ((off_t)base + XBIU_IMG_REVISON_OFFSET)) {
 		printf("Seek Qspi MTD partition failed\n");
+		ret = XST_FAILURE;
 		goto END;
 	}
 
@@ -925,10 +5247,12 @@ static int print_qspi_mfg_info(void)
 
 	printf("%s\n", qspi_mfg_info);
 
-	ret = print_image_rev_info("/dev/mtd5", "ImageA");
+	ret = print_image_rev_info("/dev/mtd5", 0U, "ImageA");
 	if (ret == XST_SUCCESS) {
-		ret = print_image_rev_info("/dev/mtd7", "ImageB");
+		ret = print_image_rev_info("/dev/mtd7", 0U, "ImageB");
 	}
+	if (ret == XST_SUCCESS)
+		print_recovery_status();
 
 END:
 	close(fd_pers_reg);
@@ -945,11 +5269,141 @@ END:
  *****************************************************************************/
 static int clear_multiboot_val(void)
 {
-	int ret = XST_FAILURE;
+	return config_reg_write(CSU_MULTI_BOOT_REG, CSU_MULTI_BOOT_MASK, 0U);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function writes val to a sysfs attribute with a single write().
+ *
+ * @param	sysfs_file is the path of the sysfs attribute
+ * @param	val is the string to be written
+ *
+ * @return	XST_SUCCESS on success and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int sysfs_write(const char *sysfs_file, const char *val)
+{
+	int fd, ret = XST_FAILURE;
+	ssize_t len = strlen(val);
+
+	fd = open(sysfs_file, O_WRONLY);
+	if (fd < 0) {
+		printf("Open %s failed: %s\n", sysfs_file, strerror(errno));
+		return ret;
+	}
+
+	do {
+		ret = write(fd, val, len);
+	} while ((ret < 0) && (errno == EINTR));
+	if (ret != len) {
+		printf("Write %s failed: %s\n", sysfs_file,
+		       (ret < 0) ? strerror(errno) : "short write");
+		ret = XST_FAILURE;
+		goto END;
+	}
+	ret = XST_SUCCESS;
+
+END:
+	if ((close(fd) != 0) && (ret == XST_SUCCESS)) {
+		printf("Write %s failed: %s\n", sysfs_file, strerror(errno));
+		ret = XST_FAILURE;
+	}
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function reads a sysfs attribute into buf as a NUL terminated string.
+ *
+ * @param	sysfs_file is the path of the sysfs attribute
+ * @param	buf is a place holder for the attribute value
+ * @param	size denotes the size of buf
+ *
+ * @return	XST_SUCCESS on success and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int sysfs_read(const char *sysfs_file, char *buf, unsigned int size)
+{
+	int fd;
+	ssize_t ret;
+
+	fd = open(sysfs_file, O_RDONLY);
+	if (fd < 0)
+		return XST_FAILURE;
+
+	do {
+		ret = read(fd, buf, size - 1U);
+	} while ((ret < 0) && (errno == EINTR));
+	close(fd);
+	if (ret <= 0)
+		return XST_FAILURE;
+	buf[ret] = '\0';
+
+	return XST_SUCCESS;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function writes the bits of val selected by mask to a CSU/PMU
+ * configuration register through the zynqmp firmware sysfs interface.
+ *
+ * @param	reg is the address of the register
+ * @param	mask selects the bits to be written
+ * @param	val is the value to be written
+ *
+ * @return	XST_SUCCESS on success and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int config_reg_write(unsigned int reg, unsigned int mask,
+			    unsigned int val)
+{
+	char buf[XBIU_CONFIG_REG_BUF_SIZE];
+
+	/* The firmware drops the last byte written, as echo's newline */
+	snprintf(buf, sizeof(buf), "0x%x 0x%x 0x%x\n", reg, mask, val);
+
+	return sysfs_write(XBIU_CONFIG_REG_FILE, buf);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function reads a CSU/PMU configuration register through the zynqmp
+ * firmware sysfs interface. The register address is written first and the
+ * attribute then reads back its value.
+ *
+ * @param	reg is the address of the register
+ * @param	val is a place holder for the register value
+ *
+ * @return	XST_SUCCESS on success and XST_FAILURE on failure
+ *
+ *****************************************************************************/
+static int config_reg_read(unsigned int reg, unsigned int *val)
+{
+	char buf[XBIU_CONFIG_REG_BUF_SIZE];
+	char *end = NULL;
+	int fd;
+
+	/* Silently report missing support, -p runs on boards without it */
+	fd = open(XBIU_CONFIG_REG_FILE, O_WRONLY);
+	if (fd < 0)
+		return XST_FAILURE;
+	close(fd);
+
+	snprintf(buf, sizeof(buf), "0x%x\n", reg);
+	if (sysfs_write(XBIU_CONFIG_REG_FILE, buf) != XST_SUCCESS)
+		return XST_FAILURE;
+
+	if (sysfs_read(XBIU_CONFIG_REG_FILE, buf, sizeof(buf)) != XST_SUCCESS)
+		return XST_FAILURE;
 
-	ret = system("echo 0xffca0010 0xfffffff 0x0 \
-	> /sys/firmware/zynqmp/config_reg");
-	if(ret)
+	errno = 0;
+	*val = (unsigned int)strtoul(buf, &end, 0);
+	if ((errno != 0) || (end == buf))
 		return XST_FAILURE;
 
 	return XST_SUCCESS;
@@ -993,11 +5447,45 @@ static char* check_image_update_status(void)
 static void print_usage(void)
 {
 	printf("\nUsage: [image_update/xmutil bootfw_update] [option]...\n\n");
-	printf("  -i      updates bootfw image with bootfw bin file passed as argument,\n");
+	printf("  -i      updates bootfw image with bootfw bin file or http:// URL passed as argument,\n");
 	printf("            with the current configuration, %s bank would be updated.\n", get_nxt_img_update());
 	printf("  -p      prints persistent status registers.\n");
 	printf("  -v      marks the current running bootfw image as bootable,");
 	printf(" %s\n",check_image_update_status());
-	printf("  -h      prints menu.\n\n");
+	printf("  -h      prints menu.\n");
+	printf("  --clone copies the running bootfw image to the %s bank without\n", get_nxt_img_update());
+	printf("          an input file.\n");
+	printf("  --chunk-size <bytes[K|M]>\n");
+	printf("          size of each write to Qspi, aligned to the flash erase/write size.\n");
+	printf("  --bw-limit <bytes[K|M]>\n");
+	printf("          Qspi program and readback bandwidth of an update per second.\n");
+	printf("  --idle  runs an update at idle CPU and I/O priority.\n");
+	printf("  --step-budget <ms>\n");
+	printf("          yields between erase blocks after running for <ms>.\n");
+	printf("  --dry-run\n");
+	printf("          with -i, plans the update and predicts its duration without\n");
+	printf("          writing to Qspi.\n");
+	printf("  --calibrate\n");
+	printf("          measures Qspi erase/program/read timing for --dry-run.\n");
+	printf("  --metrics-file <path>\n");
+	printf("          node_exporter textfile collector file the run is exported to.\n");
+	printf("  --recovery\n");
+	printf("          verifies the recovery image located by the persistent registers;\n");
+	printf("          with -i or --clone, writes it instead of the %s bank.\n", get_nxt_img_update());
+	printf("  --heartbeat <path>\n");
+	printf("          writes a byte to <path>, a file or watchdog device, at least\n");
+	printf("          every %u ms while Qspi is being erased or programmed.\n", XBIU_HEARTBEAT_MS);
+	printf("  --unit-timeout <ms>\n");
+	printf("          aborts a bank write when one erase block takes over <ms>.\n");
+	printf("  --no-progress\n");
+	printf("          disables progress reporting on stderr.\n");
+	printf("  --scrub checks both banks against the image manifest and repairs\n");
+	printf("          the persistent registers.\n");
+	printf("  --scrub-interval <seconds>\n");
+	printf("          repeats the scrub every <seconds>.\n");
+	printf("  --scrub-rate <bytes[K|M]>\n");
+	printf("          Qspi read bandwidth of the scrub per second, 1M by default.\n");
+	printf("  --wear-threshold <count>\n");
+	printf("          erase count of the persistent register partitions to warn at.\n\n");
 }
 
@@ -0,0 +1,130 @@
+/******************************************************************************
+* Copyright (c) 2022 - 2025, Advanced Micro Devices, Inc. All Rights Reserved.
+* SPDX-License-Identifier: MIT
+******************************************************************************/
+
+/*
+ * Checks that calculate_checksum_parallel and crc_shift match the serial
+ * calculate_image_checksum over random sizes and alignments. The test is
+ * built against image_update.c so that it exercises the static functions
+ * of the tool.
+ */
+#define main image_update_main
+#include "../image_update.c"
+#undef main
+
+#define XBIU_TEST_DATA_SIZE	(20U * 1024U * 1024U)
+#define XBIU_TEST_ROUNDS	(48U)
+#define XBIU_TEST_SEED		(0x1D5EEDU)
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function returns the next value of a xorshift pseudo random sequence,
+ * so that the test data does not depend on the C library.
+ *
+ * @param	state is the state of the sequence
+ *
+ * @return	Next pseudo random value
+ *
+ *****************************************************************************/
+static unsigned int test_rand(unsigned int *state)
+{
+	*state ^= *state << 13U;
+	*state ^= *state >> 17U;
+	*state ^= *state << 5U;
+
+	return *state;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function checksums one random range of the test data serially, in
+ * parallel from the data file, and as two halves merged with crc_shift.
+ *
+ * @param	data is the test data
+ * @param	fd is the file descriptor of the test data file
+ * @param	base is the offset of the range
+ * @param	len denotes number of bytes of the range
+ *
+ * @return	XST_SUCCESS if all checksums match and XST_FAILURE otherwise
+ *
+ *****************************************************************************/
+static int test_range(char *data, int fd, unsigned int base, unsigned int len)
+{
+	unsigned int serial = 0xFFFFFFFFU, parallel = 0xFFFFFFFFU;
+	unsigned int head = 0xFFFFFFFFU, tail = 0U, split = len / 3U;
+
+	calculate_image_checksum(data + base, len, &serial);
+
+	if (calculate_checksum_parallel(fd, base, len, &parallel) !=
+	    XST_SUCCESS) {
+		printf("FAIL: parallel checksum of 0x%x bytes at 0x%x failed\n",
+		       len, base);
+		return XST_FAILURE;
+	}
+
+	calculate_image_checksum(data + base, split, &head);
+	calculate_image_checksum(data + base + split, len - split, &tail);
+	head = crc_shift(head, len - split) ^ tail;
+
+	if ((parallel != serial) || (head != serial)) {
+		printf("FAIL: 0x%x bytes at 0x%x: serial %08x parallel %08x combined %08x\n",
+		       len, base, serial, parallel, head);
+		return XST_FAILURE;
+	}
+
+	return XST_SUCCESS;
+}
+
+int main(void)
+{
+	char path[] = "/tmp/crc_test.XXXXXX";
+	unsigned int state = XBIU_TEST_SEED;
+	unsigned int idx, base, len;
+	int fd, ret = XST_FAILURE;
+	char *data;
+
+	data = (char *)malloc(XBIU_TEST_DATA_SIZE);
+	fd = mkstemp(path);
+	if (!data || (fd < 0) || (pool_init() != XST_SUCCESS)) {
+		printf("FAIL: test setup failed\n");
+		goto END;
+	}
+	unlink(path);
+
+	for (idx = 0U; idx < XBIU_TEST_DATA_SIZE; idx++)
+		data[idx] = (char)test_rand(&state);
+	if (write_full(fd, data, XBIU_TEST_DATA_SIZE) != XST_SUCCESS) {
+		printf("FAIL: writing test data failed\n");
+		goto END;
+	}
+
+	ret = XST_SUCCESS;
+	for (idx = 0U; idx < XBIU_TEST_ROUNDS; idx++) {
+		base = test_rand(&state) % 4099U;
+		/* Half of the rounds stay below the parallel threshold */
+		if (idx & 1U)
+			len = XBIU_CRC_PARALLEL_MIN + (test_rand(&state) %
+				(XBIU_TEST_DATA_SIZE - XBIU_CRC_PARALLEL_MIN -
+				 base));
+		else
+			len = test_rand(&state) % (2U * XBIU_WRITE_CHUNK_SIZE);
+		if (test_range(data, fd, base, len) != XST_SUCCESS)
+			ret = XST_FAILURE;
+	}
+
+	/* Whole data file, unaligned */
+	if (test_range(data, fd, 1U, XBIU_TEST_DATA_SIZE - 1U) != XST_SUCCESS)
+		ret = XST_FAILURE;
+
+	printf("%s: crc_test, %u ranges\n",
+	       (ret == XST_SUCCESS) ? "PASS" : "FAIL", XBIU_TEST_ROUNDS + 1U);
+
+END:
+	if (fd >= 0)
+		close(fd);
+	free(data);
+	return (ret == XST_SUCCESS) ? 0 : 1;
+}
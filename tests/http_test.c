@@ -0,0 +1,346 @@
+/******************************************************************************
+* Copyright (c) 2022 - 2025, Advanced Micro Devices, Inc. All Rights Reserved.
+* SPDX-License-Identifier: MIT
+******************************************************************************/
+
+/*
+ * Downloads a boot image through read_http_source from a loopback HTTP
+ * server that drops connections mid-body and honours Range requests. It
+ * checks the resume, the refusal of an image whose length changed between
+ * connections and that stream_complete rejects a stream of unknown length
+ * ending early. The test is built against image_update.c so that it
+ * exercises the static functions of the tool.
+ */
+#define main image_update_main
+#include "../image_update.c"
+#undef main
+
+#define XBIU_TEST_IMAGE_LEN		(300000U)
+#define XBIU_TEST_BLOCK_SIZE	(0x10000U)
+#define XBIU_TEST_DROP_AFTER	(70000U)
+#define XBIU_TEST_MAX_CONNS		(16U)
+
+/* Loopback HTTP server and the behaviour of its responses */
+struct test_server {
+	int listen_fd;
+	unsigned int port;
+	const char *image;
+	unsigned int len;
+	unsigned int drops;
+	unsigned int drop_after;
+	int no_length;
+	unsigned int total_skew;
+	unsigned int connections;
+	unsigned int range[XBIU_TEST_MAX_CONNS];
+	volatile int stop;
+};
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function builds a boot image of XBIU_TEST_IMAGE_LEN bytes with a boot
+ * header and two partition headers describing the whole image.
+ *
+ * @param	image is a place holder for the image
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void test_build_image(char *image)
+{
+	unsigned int idx, state = 0x5EEDU;
+	unsigned int words[][2] = {
+		{XBIU_BH_FSBL_OFFSET, 0x800U},
+		{XBIU_BH_FSBL_TOTAL_LEN, 0x1000U},
+		{XBIU_BH_PHT_OFFSET, 0x1100U},
+		{0x1100U + XBIU_PH_TOTAL_WORD_LEN, 0x1000U / 4U},
+		{0x1100U + XBIU_PH_NEXT_WORD_OFFSET, 0x1140U / 4U},
+		{0x1100U + XBIU_PH_DATA_WORD_OFFSET, 0x800U / 4U},
+		{0x1140U + XBIU_PH_TOTAL_WORD_LEN,
+		 (XBIU_TEST_IMAGE_LEN - 0x2000U) / 4U},
+		{0x1140U + XBIU_PH_NEXT_WORD_OFFSET, 0U},
+		{0x1140U + XBIU_PH_DATA_WORD_OFFSET, 0x2000U / 4U},
+	};
+
+	for (idx = 0U; idx < XBIU_TEST_IMAGE_LEN; idx++) {
+		state = (state * 1103515245U) + 12345U;
+		image[idx] = (char)(state >> 16U);
+	}
+	memcpy(&image[XBIU_IDEN_STR_OFFSET], "XNLX", XBIU_IDEN_STR_LEN);
+	for (idx = 0U; idx < (sizeof(words) / sizeof(words[0U])); idx++)
+		memcpy(&image[words[idx][0U]], &words[idx][1U], 4U);
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function answers one HTTP request. The first srv->drops responses
+ * are cut after srv->drop_after bytes of body.
+ *
+ * @param	srv is the test server
+ * @param	sock is the accepted connection
+ *
+ * @return	None
+ *
+ *****************************************************************************/
+static void test_serve(struct test_server *srv, int sock)
+{
+	char req[XBIU_HTTP_HDR_LEN], hdr[256U];
+	unsigned int idx = 0U, start = 0U, limit, sent;
+	char *range;
+	ssize_t ret;
+
+	while (idx < (sizeof(req) - 1U)) {
+		ret = recv(sock, &req[idx], sizeof(req) - 1U - idx, 0);
+		if (ret <= 0)
+			return;
+		idx += ret;
+		req[idx] = '\0';
+		if (strstr(req, "\r\n\r\n"))
+			break;
+	}
+
+	range = strstr(req, "Range: bytes=");
+	if (range)
+		(void)sscanf(range, "Range: bytes=%u-", &start);
+	if (srv->connections < XBIU_TEST_MAX_CONNS)
+		srv->range[srv->connections] = start;
+
+	if (srv->no_length) {
+		start = 0U;
+		snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n\r\n");
+	} else if (range) {
+		snprintf(hdr, sizeof(hdr), "HTTP/1.0 206 Partial Content\r\n"
+			 "Content-Range: bytes %u-%u/%u\r\n"
+			 "Content-Length: %u\r\n\r\n", start, srv->len - 1U,
+			 srv->len + srv->total_skew, srv->len - start);
+	} else {
+		snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+			 "Content-Length: %u\r\n\r\n", srv->len);
+	}
+
+	limit = srv->len - start;
+	if ((srv->connections < srv->drops) && (limit > srv->drop_after))
+		limit = srv->drop_after;
+	srv->connections++;
+
+	if (send(sock, hdr, strlen(hdr), MSG_NOSIGNAL) < 0)
+		return;
+	for (sent = 0U; sent < limit; sent += ret) {
+		ret = send(sock, srv->image + start + sent, limit - sent,
+			   MSG_NOSIGNAL);
+		if (ret <= 0)
+			return;
+	}
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function is the thread of the test server, serving connections one
+ * at a time until stop is set.
+ *
+ * @param	arg points to the test_server
+ *
+ * @return	NULL
+ *
+ *****************************************************************************/
+static void *test_server_thread(void *arg)
+{
+	struct test_server *srv = (struct test_server *)arg;
+	struct pollfd pfd;
+	int sock;
+
+	pfd.fd = srv->listen_fd;
+	pfd.events = POLLIN;
+	while (!srv->stop) {
+		if (poll(&pfd, 1U, 50) <= 0)
+			continue;
+		sock = accept(srv->listen_fd, NULL, NULL);
+		if (sock < 0)
+			continue;
+		test_serve(srv, sock);
+		close(sock);
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function starts a test server on a free loopback port, downloads the
+ * image from it the way stream_reader does, one block at a time, and stops
+ * the server.
+ *
+ * @param	srv is the test server, configured by the caller
+ * @param	buf is a place holder for the downloaded data
+ * @param	received is a place holder for number of bytes downloaded
+ *
+ * @return	XST_SUCCESS if the download completed and XST_FAILURE otherwise
+ *
+ *****************************************************************************/
+static int test_download(struct test_server *srv, char *buf,
+			 unsigned int *received)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	pthread_t thread;
+	char url[64U];
+	unsigned int off = 0U, want;
+	int ret = XST_FAILURE;
+	int rd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	srv->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if ((srv->listen_fd < 0) ||
+	    (bind(srv->listen_fd, (struct sockaddr *)&addr,
+		  sizeof(addr)) != 0) ||
+	    (listen(srv->listen_fd, 4) != 0) ||
+	    (getsockname(srv->listen_fd, (struct sockaddr *)&addr,
+			 &addr_len) != 0) ||
+	    (pthread_create(&thread, NULL, test_server_thread, srv) != 0)) {
+		printf("FAIL: starting the test server failed\n");
+		if (srv->listen_fd >= 0)
+			close(srv->listen_fd);
+		return ret;
+	}
+	srv->port = ntohs(addr.sin_port);
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/BOOT.BIN", srv->port);
+	if (open_image_url(url) != XST_SUCCESS)
+		goto END;
+
+	for (;;) {
+		want = XBIU_TEST_BLOCK_SIZE;
+		if ((http_src.len != 0U) && ((http_src.len - off) < want))
+			want = http_src.len - off;
+		if (want == 0U)
+			break;
+		rd = read_http_source(&http_src, buf + off, off, want);
+		if (rd < 0)
+			goto END;
+		off += rd;
+		if ((unsigned int)rd < want)
+			break;
+	}
+	*received = off;
+	ret = XST_SUCCESS;
+
+END:
+	http_close(&http_src);
+	srv->stop = 1;
+	pthread_join(thread, NULL);
+	close(srv->listen_fd);
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+ * @brief
+ * This function writes the downloaded data to a temporary file and checks it
+ * with stream_complete as stream_image does for a stream of unknown length.
+ *
+ * @param	buf is the downloaded data
+ * @param	received denotes number of bytes downloaded
+ *
+ * @return	Result of stream_complete, XST_FAILURE on setup failure
+ *
+ *****************************************************************************/
+static int test_stream_complete(char *buf, unsigned int received)
+{
+	char path[] = "/tmp/http_test.XXXXXX";
+	int fd, ret = XST_FAILURE;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return ret;
+	unlink(path);
+
+	if (write_full(fd, buf, received) == XST_SUCCESS)
+		ret = stream_complete(fd, 0U, 2U * XBIU_TEST_IMAGE_LEN, 0U,
+				      received);
+	close(fd);
+
+	return ret;
+}
+
+int main(void)
+{
+	struct test_server srv;
+	unsigned int received = 0U, fails = 0U;
+	char *image, *buf;
+
+	image = (char *)malloc(XBIU_TEST_IMAGE_LEN);
+	buf = (char *)malloc(XBIU_TEST_IMAGE_LEN);
+	if (!image || !buf) {
+		printf("FAIL: test setup failed\n");
+		return 1;
+	}
+	test_build_image(image);
+
+	/* Two dropped connections are resumed at the interrupted block */
+	memset(&srv, 0, sizeof(srv));
+	srv.image = image;
+	srv.len = XBIU_TEST_IMAGE_LEN;
+	srv.drops = 2U;
+	srv.drop_after = XBIU_TEST_DROP_AFTER;
+	memset(buf, 0, XBIU_TEST_IMAGE_LEN);
+	if ((test_download(&srv, buf, &received) != XST_SUCCESS) ||
+	    (received != XBIU_TEST_IMAGE_LEN) ||
+	    (memcmp(buf, image, XBIU_TEST_IMAGE_LEN) != 0) ||
+	    (srv.connections != 3U) || (srv.range[1U] != 0x10000U) ||
+	    (srv.range[2U] != 0x20000U)) {
+		printf("FAIL: resume, %u bytes over %u connections\n",
+		       received, srv.connections);
+		fails++;
+	}
+
+	/* An image whose length changed is refused on resume */
+	memset(&srv, 0, sizeof(srv));
+	srv.image = image;
+	srv.len = XBIU_TEST_IMAGE_LEN;
+	srv.drops = 1U;
+	srv.drop_after = XBIU_TEST_DROP_AFTER;
+	srv.total_skew = 4U;
+	if (test_download(&srv, buf, &received) == XST_SUCCESS) {
+		printf("FAIL: changed image length was accepted\n");
+		fails++;
+	}
+
+	/* Without Content-Length, a complete image is accepted */
+	memset(&srv, 0, sizeof(srv));
+	srv.image = image;
+	srv.len = XBIU_TEST_IMAGE_LEN;
+	srv.no_length = 1;
+	if ((test_download(&srv, buf, &received) != XST_SUCCESS) ||
+	    (received != XBIU_TEST_IMAGE_LEN) ||
+	    (test_stream_complete(buf, received) != XST_SUCCESS)) {
+		printf("FAIL: complete image without length, %u bytes\n",
+		       received);
+		fails++;
+	}
+
+	/* Without Content-Length, a dropped connection is not the end */
+	memset(&srv, 0, sizeof(srv));
+	srv.image = image;
+	srv.len = XBIU_TEST_IMAGE_LEN;
+	srv.no_length = 1;
+	srv.drops = 1U;
+	srv.drop_after = 200000U;
+	if ((test_download(&srv, buf, &received) != XST_SUCCESS) ||
+	    (received != srv.drop_after) ||
+	    (test_stream_complete(buf, received) == XST_SUCCESS)) {
+		printf("FAIL: early end of stream was accepted, %u bytes\n",
+		       received);
+		fails++;
+	}
+
+	printf("%s: http_test, 4 cases\n", (fails == 0U) ? "PASS" : "FAIL");
+
+	free(image);
+	free(buf);
+	return (fails == 0U) ? 0 : 1;
+}